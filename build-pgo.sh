@@ -0,0 +1,113 @@
+#!/bin/sh
+
+#
+# Builds an optimized (Release, LTO, profile guided) np1sec plugin in two
+# stages. --stage=generate builds the plugin instrumented; use it in Pidgin
+# for a while (joining rooms, chatting, closing windows), then quit Pidgin
+# to write out the profile. --stage=use rebuilds the plugin with it.
+#
+# Only a real Pidgin session runs the plugin's code, the simulator and the
+# replay tool exercise (n+1)sec itself, which is built separately.
+#
+
+set -e
+
+BUILD_DIR=build-pgo
+NP1SEC_LIB_DIR=
+NP1SEC_INC_DIR=
+PIDGIN_INC_DIR=/usr/include
+STAGE=
+
+print_help() {
+	echo "Usage: $0 [options]"
+	echo "Options:"
+	echo "  --help                    # Show this help"
+	echo "  --np1sec-lib-dir=<dir>    # Where libnp1sec.so can be found"
+	echo "  --np1sec-inc-dir=<dir>    # Where np1sec headers can be found"
+	echo "  --pidgin-inc-dir=<dir>    # Where pidgin headers can be found (default /usr/include)"
+	echo "  --build-dir=<dir>         # Build directory (default build-pgo)"
+	echo "  --stage=<stage>           # generate or use"
+	echo ""
+	echo "Run with --stage=generate, use the instrumented libnp1sec-plugin.so in"
+	echo "Pidgin for a while and quit it, then run with --stage=use."
+}
+
+for i in "$@"; do
+	case $i in
+		--np1sec-lib-dir=*)
+			NP1SEC_LIB_DIR="${i#*=}"
+			;;
+		--np1sec-inc-dir=*)
+			NP1SEC_INC_DIR="${i#*=}"
+			;;
+		--pidgin-inc-dir=*)
+			PIDGIN_INC_DIR="${i#*=}"
+			;;
+		--build-dir=*)
+			BUILD_DIR="${i#*=}"
+			;;
+		--stage=*)
+			STAGE="${i#*=}"
+			;;
+		-h|--help)
+			print_help
+			exit
+			;;
+		*)
+			echo "Error: unknown option \"${i}\""
+			print_help
+			exit 1
+			;;
+	esac
+done
+
+if [ -z "${NP1SEC_LIB_DIR}" -o -z "${NP1SEC_INC_DIR}" -o -z "${STAGE}" ]; then
+	print_help
+	exit 1
+fi
+
+SOURCE_DIR="$(cd "$(dirname "$0")" && pwd)"
+mkdir -p "${BUILD_DIR}"
+BUILD_DIR="$(cd "${BUILD_DIR}" && pwd)"
+PROFILE_DIR="${BUILD_DIR}/pgo-profile"
+
+NPROC=1
+if [ "$(expr substr $(uname -s) 1 5)" = "Linux" ]; then
+	NPROC=`nproc`
+fi
+
+# Both builds must happen in the same directory, GCC finds the profile of
+# an object file by the object's path.
+build() {
+	(cd "${BUILD_DIR}" && cmake "${SOURCE_DIR}" \
+		-DCMAKE_BUILD_TYPE=Release \
+		-DPGO=$1 \
+		-DPGO_DIR="${PROFILE_DIR}" \
+		-DPIDGIN_INC_DIR="${PIDGIN_INC_DIR}" \
+		-DNP1SEC_LIB_DIR="${NP1SEC_LIB_DIR}" \
+		-DNP1SEC_INC_DIR="${NP1SEC_INC_DIR}")
+	make -C "${BUILD_DIR}" clean
+	make -C "${BUILD_DIR}" -j ${NPROC}
+}
+
+case ${STAGE} in
+	generate)
+		rm -rf "${PROFILE_DIR}"
+		build generate
+		echo "Use the plugin in Pidgin and quit it, then run with --stage=use."
+		;;
+	use)
+		if [ -z "$(find "${PROFILE_DIR}" -name '*.gcda' 2>/dev/null)" ]; then
+			echo "Error: no profile in ${PROFILE_DIR}, run Pidgin with the plugin"
+			echo "built by --stage=generate first"
+			exit 1
+		fi
+		build use
+		;;
+	*)
+		echo "Error: unknown stage \"${STAGE}\""
+		exit 1
+		;;
+esac
+
+echo "Plugin: ${BUILD_DIR}/libnp1sec-plugin.so"
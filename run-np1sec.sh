@@ -16,6 +16,7 @@ FORCE=false
 NP1SEC_TEST_CLIENT_BRANCH=master
 NP1SEC_BRANCH=master
 PIDGIN_HOME=pidgin-home
+BUILD_TYPE=Debug
 
 USE_THIS_SCRIPT=false
 
@@ -27,6 +28,7 @@ print_help() {
 	echo "  --np1sec-branch=<branch-name>  # Select a specific np1sec branch"
 	echo "  --use-this-script              # Don't download the newest version of this script, but use this one"
 	echo "  --config=<dir>                 # Set path to pidgin's config directory"
+	echo "  --build-type=<type>            # Debug (default, with ASAN), Release or RelWithDebInfo"
 	echo "  --force                        # Ignore missing dependencies"
 }
 
@@ -41,6 +43,9 @@ for i in "$@"; do
 		-c=*|--config=*)
 			PIDGIN_HOME="${i#*=}"
 			;;
+		--build-type=*)
+			BUILD_TYPE="${i#*=}"
+			;;
 		-u|--use-this-script)
 			USE_THIS_SCRIPT=true
 			;;
@@ -68,6 +73,7 @@ if [ "${USE_THIS_SCRIPT}" = false ]; then
 		       --client-branch=${NP1SEC_TEST_CLIENT_BRANCH} \
 					 --np1sec-branch=${NP1SEC_BRANCH} \
 					 --config=${PIDGIN_HOME} \
+					 --build-type=${BUILD_TYPE} \
 					 $([ "$FORCE" = true ] && echo "--force")
 	exit
 fi
@@ -136,7 +142,7 @@ if [ -n "${DEPS}" ]; then
 	echo "Ignoring missing dependencies."
 fi
 
-if testasan; then
+if [ "${BUILD_TYPE}" = Debug ] && testasan; then
 	export CFLAGS="-fsanitize=address -ggdb"
 	export CXXFLAGS="-fsanitize=address -ggdb"
 fi
@@ -166,6 +172,13 @@ if [ ! -x bin/bin/pidgin ]; then
 	cd ..
 fi
 
+# Start np1sec and the plugin from scratch when the build type changes.
+PREVIOUS_BUILD_TYPE=`cat build-type 2>/dev/null || echo Debug`
+if [ "${PREVIOUS_BUILD_TYPE}" != "${BUILD_TYPE}" ]; then
+	rm -rf np1sec np1sec-test-client
+fi
+echo "${BUILD_TYPE}" > build-type
+
 FORCE_REBUILD_CLIENT=false
 
 if [ ! -d np1sec ]; then
@@ -177,7 +190,7 @@ if [ ! -d np1sec ]; then
 	cd ..
 	mkdir np1sec-build
 	cd np1sec-build
-	cmake ../np1sec -DCMAKE_INSTALL_PREFIX="${WORKDIR}"/bin -DBUILD_TESTS=Off -DCMAKE_BUILD_TYPE=Debug
+	cmake ../np1sec -DCMAKE_INSTALL_PREFIX="${WORKDIR}"/bin -DBUILD_TESTS=Off -DCMAKE_BUILD_TYPE=${BUILD_TYPE}
 	make -j ${NPROC} ${MAKEOPTS}
 	cp "`libname np1sec`" ../bin/"`libdir`"/
 	cd ..
@@ -208,7 +221,7 @@ if [ ! -d np1sec-test-client ]; then
 		-DPIDGIN_INC_DIR="${WORKDIR}"/bin/include \
 		-DNP1SEC_LIB_DIR="${WORKDIR}"/bin/lib \
 		-DNP1SEC_INC_DIR="${WORKDIR}"/np1sec \
-		-DCMAKE_BUILD_TYPE=Debug
+		-DCMAKE_BUILD_TYPE=${BUILD_TYPE}
 	make ${MAKEOPTS}
 	cp "`libname np1sec-plugin`" ../bin/
 	cd ..
@@ -0,0 +1,719 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/utility/string_ref.hpp>
+
+namespace np1sec_plugin {
+
+/*
+ * Segment file of the np1sec stanzas a room sent and received.
+ *
+ * Records are appended while capturing. When the capture is closed an
+ * index is appended after them, so a File can memory map the capture and
+ * find a time window or one sender's records without reading the rest.
+ * A capture that was never closed (e.g. after a crash) has no index, one
+ * is then built by scanning the records once (and can be written out
+ * with File::write_index).
+ *
+ * Layout (integers are little endian):
+ *
+ *   header:  "NP1SCAP" version:u8 username:str room:str start:u64
+ *            (start: unix time in us)
+ *   record*: kind:u8 time:u64 sender:str message:str
+ *            (time: us since start, never decreasing)
+ *   index:   "NP1SIDX\0" records:u32 senders:u32
+ *            entry*records:  time:u64 offset:u64 sender:u32 kind:u8 pad:3
+ *            sender*senders: name:str count:u32 record_number:u32*count
+ *   trailer: index_offset:u64 "NP1SEND\0"
+ *
+ *   str:     length:u32 bytes
+ */
+namespace capture {
+
+static const char magic[]         = "NP1SCAP";
+static const char index_magic[]   = "NP1SIDX";
+static const char trailer_magic[] = "NP1SEND";
+static const uint8_t version = 2;
+
+static const size_t entry_size   = 24;
+static const size_t trailer_size = 16;
+
+enum class Kind : uint8_t { received = 0, sent = 1, history = 2 };
+
+const char* kind_name(Kind);
+
+/* Points into the mapped file, valid as long as the File is. */
+struct Record {
+    Kind kind;
+    uint64_t time_us;
+    boost::string_ref sender;
+    boost::string_ref message;
+};
+
+/*
+ * Accumulates the index while records are written (or scanned) and
+ * serializes it.
+ */
+class IndexBuilder {
+public:
+    void add(Kind, uint64_t time_us, uint64_t offset, boost::string_ref sender);
+    std::string serialize() const;
+
+private:
+    struct Entry {
+        uint64_t time_us;
+        uint64_t offset;
+        uint32_t sender;
+        Kind kind;
+    };
+
+    std::vector<Entry> _entries;
+    std::map<std::string, uint32_t> _sender_ids;
+    std::vector<std::vector<uint32_t>> _postings;
+};
+
+class Writer {
+public:
+    /* Throws std::runtime_error if the file can't be created. start_us
+     * defaults to now. */
+    Writer( const std::string& path
+          , const std::string& username
+          , const std::string& room
+          , uint64_t start_us = 0);
+
+    /* Appends the index. */
+    ~Writer();
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    /* Timestamped with the time since the writer was created. */
+    void write(Kind, const std::string& sender, const std::string& message);
+
+    void write(Kind, uint64_t time_us, boost::string_ref sender, boost::string_ref message);
+
+    const std::string& path() const { return _path; }
+
+private:
+    void put(const void*, size_t);
+    void put_u8(uint8_t);
+    void put_u32(uint32_t);
+    void put_u64(uint64_t);
+    void put_str(boost::string_ref);
+
+private:
+    std::string _path;
+    FILE* _file;
+    uint64_t _offset = 0;
+    std::chrono::steady_clock::time_point _start;
+    IndexBuilder _index;
+};
+
+/*
+ * A read-only, memory mapped capture.
+ */
+class File {
+public:
+    /* Record numbers, e.g. all records of one sender. */
+    class Postings {
+    public:
+        size_t size() const { return _size; }
+        size_t operator[](size_t i) const;
+
+    private:
+        friend class File;
+        const uint8_t* _data = nullptr;
+        size_t _size = 0;
+    };
+
+public:
+    /* Throws std::runtime_error if the file can't be mapped or isn't
+     * a capture. */
+    File(const std::string& path);
+    ~File();
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    const std::string& path() const { return _path; }
+    const std::string& username() const { return _username; }
+    const std::string& room() const { return _room; }
+    uint64_t start_us() const { return _start_us; }
+
+    /* False if the index had to be rebuilt when opening, because there
+     * was none or it didn't match the records. */
+    bool indexed() const { return _indexed; }
+
+    size_t size() const { return _record_count; }
+    Record record(size_t i) const;
+
+    /* The range [first, last) of record numbers whose time is within
+     * [from_us, to_us). */
+    std::pair<size_t, size_t> time_range(uint64_t from_us, uint64_t to_us) const;
+
+    /* Empty if the sender never sent anything. */
+    Postings records_from(boost::string_ref sender) const;
+
+    std::vector<boost::string_ref> senders() const;
+
+    /* Append the index built when opening an unindexed capture. */
+    void write_index();
+
+private:
+    void parse_header();
+    /* False if the index is malformed or refers to anything outside
+     * [_records_offset, records_end). */
+    bool parse_index(const uint8_t* index, size_t size, size_t records_end);
+
+    /* Scan the records in [_records_offset, records_end). */
+    void build_index(size_t records_end);
+
+    uint64_t entry_time(size_t i) const;
+    uint64_t entry_offset(size_t i) const;
+
+private:
+    std::string _path;
+    int _fd = -1;
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+
+    std::string _username;
+    std::string _room;
+    uint64_t _start_us = 0;
+    size_t _records_offset = 0;
+
+    bool _indexed = false;
+    std::string _built_index;
+
+    size_t _record_count = 0;
+    const uint8_t* _entries = nullptr;
+    std::map<boost::string_ref, Postings> _senders;
+};
+
+} // capture namespace
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+namespace capture {
+
+namespace detail {
+    inline uint32_t get_u32(const uint8_t* p) {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) v |= uint32_t(p[i]) << (8 * i);
+        return v;
+    }
+
+    inline uint64_t get_u64(const uint8_t* p) {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) v |= uint64_t(p[i]) << (8 * i);
+        return v;
+    }
+
+    inline void put_u32(std::string& out, uint32_t v) {
+        for (int i = 0; i < 4; ++i) out += char(v >> (8 * i));
+    }
+
+    inline void put_u64(std::string& out, uint64_t v) {
+        for (int i = 0; i < 8; ++i) out += char(v >> (8 * i));
+    }
+
+    /* Bounds checked reading of the mapped file. */
+    struct Cursor {
+        const uint8_t* pos;
+        const uint8_t* end;
+
+        bool has(size_t n) const { return pos <= end && n <= size_t(end - pos); }
+
+        bool u8(uint8_t& v) {
+            if (!has(1)) return false;
+            v = *pos++;
+            return true;
+        }
+
+        bool u32(uint32_t& v) {
+            if (!has(4)) return false;
+            v = get_u32(pos);
+            pos += 4;
+            return true;
+        }
+
+        bool u64(uint64_t& v) {
+            if (!has(8)) return false;
+            v = get_u64(pos);
+            pos += 8;
+            return true;
+        }
+
+        bool str(boost::string_ref& s) {
+            uint32_t size;
+            if (!u32(size) || !has(size)) return false;
+            s = boost::string_ref(reinterpret_cast<const char*>(pos), size);
+            pos += size;
+            return true;
+        }
+    };
+} // detail namespace
+
+inline const char* kind_name(Kind kind)
+{
+    switch (kind) {
+        case Kind::received: return "received";
+        case Kind::sent:     return "sent";
+        case Kind::history:  return "history";
+    }
+    return "unknown";
+}
+
+//------------------------------------------------------------------------------
+inline void IndexBuilder::add( Kind kind
+                             , uint64_t time_us
+                             , uint64_t offset
+                             , boost::string_ref sender)
+{
+    auto i = _sender_ids.find(sender.to_string());
+
+    if (i == _sender_ids.end()) {
+        i = _sender_ids.emplace(sender.to_string(), uint32_t(_postings.size())).first;
+        _postings.emplace_back();
+    }
+
+    _postings[i->second].push_back(uint32_t(_entries.size()));
+    _entries.push_back(Entry{time_us, offset, i->second, kind});
+}
+
+inline std::string IndexBuilder::serialize() const
+{
+    std::string out(index_magic, sizeof(index_magic));
+
+    detail::put_u32(out, uint32_t(_entries.size()));
+    detail::put_u32(out, uint32_t(_postings.size()));
+
+    for (const auto& e : _entries) {
+        detail::put_u64(out, e.time_us);
+        detail::put_u64(out, e.offset);
+        detail::put_u32(out, e.sender);
+        out += char(e.kind);
+        out.append(3, '\0');
+    }
+
+    /* Ordered by id so the reader sees senders in order of appearance. */
+    std::vector<const std::string*> names(_postings.size());
+    for (const auto& s : _sender_ids) names[s.second] = &s.first;
+
+    for (size_t id = 0; id != _postings.size(); ++id) {
+        detail::put_u32(out, uint32_t(names[id]->size()));
+        out += *names[id];
+        detail::put_u32(out, uint32_t(_postings[id].size()));
+        for (auto r : _postings[id]) detail::put_u32(out, r);
+    }
+
+    return out;
+}
+
+//------------------------------------------------------------------------------
+inline Writer::Writer( const std::string& path
+                     , const std::string& username
+                     , const std::string& room
+                     , uint64_t start_us)
+    : _path(path)
+    , _file(fopen(path.c_str(), "wb"))
+    , _start(std::chrono::steady_clock::now())
+{
+    using namespace std::chrono;
+
+    if (!_file) {
+        throw std::runtime_error("can't create " + path);
+    }
+
+    if (!start_us) {
+        start_us = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    put(magic, sizeof(magic) - 1);
+    put_u8(version);
+    put_str(username);
+    put_str(room);
+    put_u64(start_us);
+}
+
+inline Writer::~Writer()
+{
+    auto index_offset = _offset;
+    auto index = _index.serialize();
+
+    put(index.data(), index.size());
+    put_u64(index_offset);
+    put(trailer_magic, sizeof(trailer_magic));
+
+    fclose(_file);
+}
+
+inline void Writer::write( Kind kind
+                         , const std::string& sender
+                         , const std::string& message)
+{
+    using namespace std::chrono;
+    write(kind, duration_cast<microseconds>(steady_clock::now() - _start).count(),
+          sender, message);
+}
+
+inline void Writer::write( Kind kind
+                         , uint64_t time_us
+                         , boost::string_ref sender
+                         , boost::string_ref message)
+{
+    _index.add(kind, time_us, _offset, sender);
+
+    put_u8(uint8_t(kind));
+    put_u64(time_us);
+    put_str(sender);
+    put_str(message);
+}
+
+inline void Writer::put(const void* data, size_t size)
+{
+    fwrite(data, 1, size, _file);
+    _offset += size;
+}
+
+inline void Writer::put_u8(uint8_t v)
+{
+    put(&v, 1);
+}
+
+inline void Writer::put_u32(uint32_t v)
+{
+    std::string b;
+    detail::put_u32(b, v);
+    put(b.data(), b.size());
+}
+
+inline void Writer::put_u64(uint64_t v)
+{
+    std::string b;
+    detail::put_u64(b, v);
+    put(b.data(), b.size());
+}
+
+inline void Writer::put_str(boost::string_ref s)
+{
+    put_u32(uint32_t(s.size()));
+    put(s.data(), s.size());
+}
+
+//------------------------------------------------------------------------------
+inline size_t File::Postings::operator[](size_t i) const
+{
+    return detail::get_u32(_data + 4 * i);
+}
+
+inline File::File(const std::string& path)
+    : _path(path)
+{
+    _fd = open(path.c_str(), O_RDONLY);
+
+    if (_fd < 0) {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    struct stat st;
+
+    if (fstat(_fd, &st) != 0 || st.st_size == 0) {
+        close(_fd);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+
+    _size = size_t(st.st_size);
+
+    auto data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+
+    if (data == MAP_FAILED) {
+        close(_fd);
+        throw std::runtime_error("can't map " + path);
+    }
+
+    _data = reinterpret_cast<const uint8_t*>(data);
+
+    try {
+        parse_header();
+
+        auto trailer = _data + _size - std::min(_size, trailer_size);
+
+        if (_size >= _records_offset + trailer_size
+            && memcmp(trailer + 8, trailer_magic, sizeof(trailer_magic)) == 0) {
+            auto index_offset = detail::get_u64(trailer);
+            auto index_end    = _size - trailer_size;
+
+            /* An index we can't trust is rebuilt from the records, as
+             * for a capture that was never closed. */
+            if (index_offset < _records_offset || index_offset > index_end) {
+                build_index(index_end);
+            }
+            else if (parse_index(_data + index_offset, index_end - index_offset, index_offset)) {
+                _indexed = true;
+            }
+            else {
+                build_index(index_offset);
+            }
+        }
+        else {
+            build_index(_size);
+        }
+    }
+    catch (...) {
+        munmap(const_cast<uint8_t*>(_data), _size);
+        close(_fd);
+        throw;
+    }
+}
+
+inline File::~File()
+{
+    munmap(const_cast<uint8_t*>(_data), _size);
+    close(_fd);
+}
+
+inline void File::parse_header()
+{
+    detail::Cursor c{_data, _data + _size};
+
+    uint8_t v;
+    boost::string_ref username, room;
+
+    if (!c.has(sizeof(magic) - 1) || memcmp(c.pos, magic, sizeof(magic) - 1) != 0) {
+        throw std::runtime_error(_path + " is not a capture file");
+    }
+
+    c.pos += sizeof(magic) - 1;
+
+    if (!c.u8(v) || v != version) {
+        throw std::runtime_error(_path + " has an unsupported capture version");
+    }
+
+    if (!c.str(username) || !c.str(room) || !c.u64(_start_us)) {
+        throw std::runtime_error(_path + " has a truncated header");
+    }
+
+    _username = username.to_string();
+    _room = room.to_string();
+    _records_offset = c.pos - _data;
+}
+
+inline bool File::parse_index(const uint8_t* index, size_t size, size_t records_end)
+{
+    detail::Cursor c{index, index + size};
+
+    uint32_t records, senders;
+
+    if (!c.has(sizeof(index_magic)) || memcmp(c.pos, index_magic, sizeof(index_magic)) != 0) {
+        return false;
+    }
+
+    c.pos += sizeof(index_magic);
+
+    if (!c.u32(records) || !c.u32(senders) || !c.has(size_t(records) * entry_size)) {
+        return false;
+    }
+
+    const uint8_t* entries = c.pos;
+    c.pos += size_t(records) * entry_size;
+
+    /* record() trusts the offsets and time_range() relies on the times
+     * being sorted. */
+    uint64_t previous_time = 0;
+
+    for (size_t i = 0; i != records; ++i) {
+        auto time   = detail::get_u64(entries + i * entry_size);
+        auto offset = detail::get_u64(entries + i * entry_size + 8);
+
+        if (time < previous_time) return false;
+        if (offset < _records_offset || offset >= records_end) return false;
+
+        previous_time = time;
+    }
+
+    std::map<boost::string_ref, Postings> sender_map;
+
+    for (uint32_t s = 0; s != senders; ++s) {
+        boost::string_ref name;
+        uint32_t count;
+
+        if (!c.str(name) || !c.u32(count) || !c.has(size_t(count) * 4)) {
+            return false;
+        }
+
+        Postings p;
+        p._data = c.pos;
+        p._size = count;
+
+        for (size_t i = 0; i != count; ++i) {
+            if (p[i] >= records) return false;
+        }
+
+        sender_map.emplace(name, p);
+
+        c.pos += size_t(count) * 4;
+    }
+
+    _record_count = records;
+    _entries = entries;
+    _senders = std::move(sender_map);
+
+    return true;
+}
+
+inline void File::build_index(size_t records_end)
+{
+    detail::Cursor c{_data + _records_offset, _data + records_end};
+    IndexBuilder builder;
+    uint64_t previous_time = 0;
+
+    while (true) {
+        auto offset = uint64_t(c.pos - _data);
+
+        uint8_t kind;
+        uint64_t time_us;
+        boost::string_ref sender, message;
+
+        /* A truncated last record is where the capture ends, so is one
+         * going back in time (it can only be garbage). */
+        if (!c.u8(kind) || !c.u64(time_us) || !c.str(sender) || !c.str(message)
+            || time_us < previous_time) {
+            break;
+        }
+
+        builder.add(Kind(kind), time_us, offset, sender);
+        previous_time = time_us;
+    }
+
+    _indexed = false;
+    _built_index = builder.serialize();
+
+    if (!parse_index(reinterpret_cast<const uint8_t*>(_built_index.data()),
+                     _built_index.size(), records_end)) {
+        throw std::runtime_error(_path + " can't be indexed");
+    }
+}
+
+inline void File::write_index()
+{
+    if (_indexed) return;
+
+    /* Records past the last complete one would be misread as the index
+     * offset, so the index replaces them. */
+    uint64_t end = _record_count
+                 ? record(_record_count - 1).message.end() - reinterpret_cast<const char*>(_data)
+                 : _records_offset;
+
+    if (truncate(_path.c_str(), off_t(end)) != 0) {
+        throw std::runtime_error("can't truncate " + _path);
+    }
+
+    FILE* f = fopen(_path.c_str(), "ab");
+
+    if (!f) {
+        throw std::runtime_error("can't write to " + _path);
+    }
+
+    std::string trailer;
+    detail::put_u64(trailer, end);
+    trailer.append(trailer_magic, sizeof(trailer_magic));
+
+    fwrite(_built_index.data(), 1, _built_index.size(), f);
+    fwrite(trailer.data(), 1, trailer.size(), f);
+    fclose(f);
+}
+
+inline uint64_t File::entry_time(size_t i) const
+{
+    return detail::get_u64(_entries + i * entry_size);
+}
+
+inline uint64_t File::entry_offset(size_t i) const
+{
+    return detail::get_u64(_entries + i * entry_size + 8);
+}
+
+inline Record File::record(size_t i) const
+{
+    detail::Cursor c{_data + entry_offset(i), _data + _size};
+
+    uint8_t kind = 0;
+    Record r;
+
+    if (!c.u8(kind) || !c.u64(r.time_us) || !c.str(r.sender) || !c.str(r.message)) {
+        throw std::runtime_error(_path + " has a corrupt record");
+    }
+
+    r.kind = Kind(kind);
+    return r;
+}
+
+inline
+std::pair<size_t, size_t> File::time_range(uint64_t from_us, uint64_t to_us) const
+{
+    /* Binary search on the (sorted) entry times. */
+    auto lower = [this] (uint64_t t) {
+        size_t lo = 0, hi = _record_count;
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            if (entry_time(mid) < t) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    };
+
+    auto first = lower(from_us);
+    return std::make_pair(first, std::max(first, lower(to_us)));
+}
+
+inline File::Postings File::records_from(boost::string_ref sender) const
+{
+    auto i = _senders.find(sender);
+    if (i == _senders.end()) return Postings();
+    return i->second;
+}
+
+inline std::vector<boost::string_ref> File::senders() const
+{
+    std::vector<boost::string_ref> result;
+    for (const auto& s : _senders) result.push_back(s.first);
+    return result;
+}
+
+} // capture namespace
+
+} // np1sec_plugin namespace
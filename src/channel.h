@@ -20,6 +20,7 @@
 
 #include <memory>
 #include <iostream>
+#include <boost/container/flat_map.hpp>
 #include <boost/optional.hpp>
 #include <boost/range/adaptor/map.hpp>
 
@@ -28,6 +29,8 @@
 #include "src/conversation.h"
 
 /* np1sec_plugin headers */
+#include "check.h"
+#include "name.h"
 #include "user_list.h"
 #include "log.h"
 
@@ -51,20 +54,40 @@ public:
     Channel(Channel&&) = default;
     Channel& operator=(Channel&&) = default;
 
-    User& add_user(const std::string&, const PublicKey&);
-    void remove_user(const std::string&);
-    User* find_user(const std::string&);
-    const User* find_user(const std::string&) const;
+    User& add_user(const Name&, const PublicKey&);
+    /* Destroys the channel if no user is left. */
+    void remove_users(const std::vector<Name>&);
+    User* find_user(const Name&);
+    const User* find_user(const Name&) const;
+    /* Only for names coming from np1sec, which aren't interned yet. */
+    User* find_user(boost::string_ref);
     const std::string& my_username() const;
     std::string channel_name() const;
 
     void send_chat_message(const std::string&);
     void invite(const std::string&, const PublicKey&);
 
+    /*
+     * Invite several users from a single np1sec task. np1sec has no
+     * multi-user invite, each invitation is still sent (and takes its
+     * protocol round) on its own, only the resulting changes to the user
+     * lists are applied in batches.
+     */
+    void invite(const std::map<std::string, PublicKey>&);
+
+    void join();
+
     void self_destruct();
 
+    /* Create the ChannelView and populate it, must be called on the GTK
+     * thread. */
+    void create_view();
+
     ChannelView* channel_view() { return _channel_view; }
 
+    /* Display a reply to something the user did in the channel window. */
+    template<class... Args> void respond(Args&&...);
+
 public:
     void user_invited(const std::string& inviter, const std::string& invitee) override;
     void invitation_cancelled(const std::string& inviter, const std::string& invitee) override;
@@ -82,15 +105,39 @@ public:
     void left() override;
 
 private:
+    /*
+     * A copy of the np1sec::Conversation state the UI needs. It is taken
+     * on the np1sec thread and handed over to the GTK thread together
+     * with each event, so the UI never has to call into np1sec.
+     */
+    struct State {
+        std::set<std::string> participants;
+        std::set<std::string> invitees;
+        bool in_chat = false;
+    };
+
     /*
      * Internal
      */
-    size_t channel_id() const { return size_t(_delegate); }
+    size_t channel_id() const { return size_t(_id); }
+
+    State snapshot() const;
+
+    /* Execute f on the GTK thread unless this channel has been
+     * destroyed by then. */
+    template<class F> void ui_post(F&& f);
 
     template<class... Args> void inform(Args&&...);
     void interpret_as_command(const std::string& msg);
-    std::map<std::string, PublicKey> get_users() const;
-    User& add_user(const std::string&,
+    void cmd_whoami(const CommandArgs&);
+    void cmd_list_users(const CommandArgs&);
+    void cmd_list_participants(const CommandArgs&);
+    void cmd_invite(const CommandArgs&);
+    void cmd_invite_all(const CommandArgs&);
+    void cmd_join(const CommandArgs&);
+    void cmd_events(const CommandArgs&);
+    void cmd_scrollback(const CommandArgs&);
+    User& add_user(const Name&,
                    const PublicKey&,
                    const std::set<std::string>& participants,
                    const std::set<std::string>& invitees);
@@ -99,12 +146,29 @@ private:
     friend class User;
     friend class ChannelView;
 
+    /* Only used on the np1sec thread, null once np1sec told us we left
+     * (it may destroy the conversation after that). */
     np1sec::Conversation* _delegate;
+    bool _left = false;
+
+    /* The conversation's address, our key in Room::_channels. Never
+     * dereferenced. */
+    np1sec::Conversation* const _id;
 
     Room& _room;
-    std::map<std::string, std::unique_ptr<User>> _users;
 
-    ChannelView* _channel_view;
+    /* Ordered by Name address, see Room::ChannelMap. */
+    boost::container::flat_map<Name, std::unique_ptr<User>> _users;
+
+    State _state;
+
+    /* Users invited several at a time whose invitation np1sec hasn't
+     * confirmed yet. */
+    std::set<Name> _bulk_invitees;
+
+    ChannelView* _channel_view = nullptr;
+
+    std::shared_ptr<Channel*> _guard;
 };
 
 } // np1sec_plugin namespace
@@ -113,29 +177,42 @@ private:
 #include "room.h"
 #include "user.h"
 #include "channel_view.h"
-#include "parser.h"
+#include "command.h"
 
 namespace np1sec_plugin {
 
 //------------------------------------------------------------------------------
 // Implementation
 //------------------------------------------------------------------------------
+/*
+ * Called on the np1sec thread, see Room::add_channel.
+ */
 inline Channel::Channel(np1sec::Conversation* delegate, Room& room)
     : _delegate(delegate)
+    , _id(delegate)
     , _room(room)
-    , _channel_view(new ChannelView(_room.shared_from_this(), *this))
+    , _state(snapshot())
+    , _guard(std::make_shared<Channel*>(this))
 {
     log(this, " Channel::Channel delegate:", delegate, " room:", &room);
+}
+
+inline void Channel::create_view()
+{
+    NP1SEC_CHECK(!_channel_view);
 
-    auto participants = _delegate->participants();
-    auto invitees     = _delegate->invitees();
+    _channel_view = new ChannelView(_room.shared_from_this(), *this);
 
-    for (const auto& username_and_key : get_users()) {
+    /* The room's user list is up to date with everything np1sec
+     * reported before it created this channel. */
+    _users.reserve(_room._users.size());
 
-        const auto& username = username_and_key.first;
-        const auto& key      = username_and_key.second;
+    for (const auto& username_and_user : _room._users) {
 
-        auto& u = add_user(username, key, participants, invitees);
+        const auto& username = username_and_user.first;
+        const auto& key      = username_and_user.second.public_key;
+
+        auto& u = add_user(username, key, _state.participants, _state.invitees);
 
         u.update_view();
     }
@@ -146,9 +223,13 @@ inline Channel::~Channel()
     log(this, " Channel::~Channel start");
     _users.clear();
 
-    if (_room.in_chat()) {
-        _delegate->leave(true /* Don't want to receive the 'left' callback */);
-    }
+    /* Once this returns np1sec no longer calls into this object and
+     * nothing else referencing it is queued on the np1sec thread. */
+    _room.np1sec_call([this] {
+        if (_room.in_chat() && !_left) {
+            _delegate->leave(true /* Don't want to receive the 'left' callback */);
+        }
+    });
 
     if (_channel_view) {
         _channel_view->reset_channel();
@@ -165,77 +246,189 @@ void Channel::send_chat_message(const std::string& msg)
         return interpret_as_command(msg.substr(1));
     }
 
-    if (!_delegate->in_chat()) {
-        return inform("You are currently not in the chat");
+    if (!_state.in_chat) {
+        return respond("You are currently not in the chat");
     }
 
-    _delegate->send_chat(msg);
+    _room.np1sec_post([this, msg] {
+        if (_delegate) _delegate->send_chat(msg);
+    });
+}
+
+inline
+Channel::State Channel::snapshot() const
+{
+    State s;
+    if (!_delegate) return s;
+    s.participants = _delegate->participants();
+    s.invitees     = _delegate->invitees();
+    s.in_chat      = _delegate->in_chat();
+    return s;
 }
 
+template<class F>
 inline
-std::map<std::string, np1sec::PublicKey> Channel::get_users() const
+void Channel::ui_post(F&& f)
 {
-    return _room._room->users();
+    std::weak_ptr<Channel*> guard = _guard;
+
+    _room.ui_post([guard, state = snapshot(), f = std::forward<F>(f)] {
+        auto self = guard.lock();
+        if (!self) return;
+        (*self)->_state = state;
+        f();
+    });
 }
 
 inline
 void Channel::interpret_as_command(const std::string& cmd)
 {
-    using namespace std;
+    static constexpr Command<Channel> commands[] = {
+        { "whoami",            "",              0, 0, &Channel::cmd_whoami },
+        { "list-users",        "",              0, 0, &Channel::cmd_list_users },
+        { "list-participants", "",              0, 0, &Channel::cmd_list_participants },
+        { "invite",            "<user>... (invitations are sent one by one)",
+                                                1, Command<Channel>::unlimited, &Channel::cmd_invite },
+        { "invite-all",        "(invitations are sent one by one)",
+                                                0, 0, &Channel::cmd_invite_all },
+        { "join",              "",              0, 0, &Channel::cmd_join },
+        { "events",            "",              0, 0, &Channel::cmd_events },
+        { "scrollback",        "[lines]",       0, 1, &Channel::cmd_scrollback },
+    };
+
+    respond("$ ", cmd);
+    dispatch_command(commands, *this, cmd);
+}
+
+inline
+void Channel::cmd_whoami(const CommandArgs&)
+{
+    respond("You're ", my_username());
+}
+
+inline
+void Channel::cmd_list_users(const CommandArgs&)
+{
+    /* Names are ordered by address, list them alphabetically. */
+    std::set<std::string> users;
 
-    Parser p(cmd);
+    for (const auto& u : _room._users) {
+        users.insert(u.first.str());
+    }
 
-    try {
-        inform("$ ", p.text);
+    respond("Users: ", util::collection(users));
+}
 
-        auto c = p.read_word();
+inline
+void Channel::cmd_list_participants(const CommandArgs&)
+{
+    respond("Users: ", util::collection(_state.participants));
+}
 
-        if (c == "help") {
-            inform("<br>"
-                   "Available commands:<br>"
-                   "&nbsp;&nbsp;&nbsp;&nbsp;help<br>"
-                   "&nbsp;&nbsp;&nbsp;&nbsp;whoami<br>"
-                   "&nbsp;&nbsp;&nbsp;&nbsp;list-users<br>");
-        }
-        else if (c == "whoami") {
-            inform("You're ", my_username());
-        }
-        else if (c == "list-users") {
-            inform("Users: ", util::collection(get_users() | boost::adaptors::map_keys));
-        }
-        else if (c == "list-participants") {
-            inform("Users: ", util::collection(_delegate->participants()));
-        }
-        else if (c == "invite") {
-            auto who = p.read_word();
-            auto users = get_users();
-            auto ui = users.find(who);
+inline
+void Channel::cmd_invite(const CommandArgs& args)
+{
+    std::map<std::string, PublicKey> invitees;
 
-            if (ui == users.end()) {
-                return inform("No such user \"", who, "\"");
-            }
+    args.for_each([&] (boost::string_ref name) {
+        auto user_i = _room._users.find(_room.find_name(name));
 
-            invite(ui->first, ui->second);
-        } 
-        else if (c == "join") {
-            _delegate->join();
-        }
-        else  {
-            inform("\"", p.text, "\" is not a valid np1sec command");
+        if (user_i == _room._users.end()) {
+            return respond("No such user \"", name, "\"");
         }
+
+        invitees.emplace(name.to_string(), user_i->second.public_key);
+    });
+
+    if (invitees.size() == 1) {
+        auto i = invitees.begin();
+        return invite(i->first, i->second);
+    }
+
+    invite(invitees);
+}
+
+inline
+void Channel::cmd_invite_all(const CommandArgs&)
+{
+    std::map<std::string, PublicKey> invitees;
+
+    for (const auto& u : _users) {
+        const auto& user = *u.second;
+
+        if (user.name() == _room.my_name()) continue;
+        if (user.has_joined() || user.is_invited()) continue;
+
+        invitees.emplace(user.name().str(), user.public_key());
+    }
+
+    if (invitees.empty()) {
+        return respond("Nobody left to invite");
     }
-    catch (...) {}
+
+    invite(invitees);
+}
+
+inline
+void Channel::cmd_join(const CommandArgs&)
+{
+    join();
+}
+
+inline
+void Channel::cmd_events(const CommandArgs&)
+{
+    respond(_room.dump_events());
+}
+
+inline
+void Channel::cmd_scrollback(const CommandArgs& args)
+{
+    if (!_channel_view) {
+        return respond("This conversation has no window");
+    }
+
+    auto& q = _channel_view->display_queue();
+    if (!args.empty()) q.set_scrollback_limit(args.number(0));
+    respond("Scrollback: ", q.scrollback_info());
 }
 
 inline
 void Channel::invite(const std::string& invitee, const PublicKey& pubkey) {
     inform("Channel::invite ", invitee);
-    _delegate->invite(invitee, pubkey);
+    _room.np1sec_post([this, invitee, pubkey] {
+        if (_delegate) _delegate->invite(invitee, pubkey);
+    });
+}
+
+inline
+void Channel::invite(const std::map<std::string, PublicKey>& invitees) {
+    if (invitees.empty()) return;
+
+    inform("Channel::invite ", util::collection(invitees | boost::adaptors::map_keys));
+
+    for (const auto& i : invitees) {
+        _bulk_invitees.insert(_room.intern(i.first));
+    }
+
+    _room.np1sec_post([this, invitees] {
+        if (!_delegate) return;
+        for (const auto& i : invitees) {
+            _delegate->invite(i.first, i.second);
+        }
+    });
+}
+
+inline
+void Channel::join() {
+    _room.np1sec_post([this] {
+        if (_delegate) _delegate->join();
+    });
 }
 
 inline std::string Channel::channel_name() const
 {
-    return std::to_string(size_t(_delegate));
+    return std::to_string(size_t(_id));
 }
 
 inline const std::string& Channel::my_username() const
@@ -246,66 +439,93 @@ inline const std::string& Channel::my_username() const
 inline
 void Channel::user_invited(const std::string& inviter, const std::string& invitee)
 {
-    inform("Channel::user_invited ", invitee, " by ", inviter);
-    if (auto u = find_user(invitee)) {
-        u->mark_as_invited();
-    }
+    ui_post([this, inviter, invitee] {
+        inform("Channel::user_invited ", invitee, " by ", inviter);
+
+        if (_bulk_invitees.erase(_room.find_name(invitee)) && _channel_view) {
+            _channel_view->batch_user_list_updates();
+        }
+
+        if (auto u = find_user(invitee)) {
+            u->mark_as_invited();
+        }
+    });
 }
 
 inline
 void Channel::invitation_cancelled(const std::string& inviter, const std::string& invitee)
 {
-    inform("Channel::invitation_cancelled ", inviter, " ", invitee);
-    if (auto u = find_user(invitee)) {
-        if (_delegate->invitees().count(invitee) == 0) {
-            u->mark_as_not_invited();
+    ui_post([this, inviter, invitee] {
+        inform("Channel::invitation_cancelled ", inviter, " ", invitee);
+        if (auto u = find_user(invitee)) {
+            if (_state.invitees.count(invitee) == 0) {
+                u->mark_as_not_invited();
+            }
         }
-    }
+    });
 }
 
 inline
 void Channel::self_destruct()
 {
-    _room._channels.erase(_delegate);
+    auto& channels = _room._channels;
+    auto i = channels.find(_id);
+
+    if (i == channels.end()) return;
+
+    /* Take this out of the map before destroying it, so nothing the
+     * destructor does sees the map half way through the erase. */
+    auto self = std::move(i->second);
+    channels.erase(i);
 }
 
-inline User& Channel::add_user( const std::string& username
+inline User& Channel::add_user( const Name& username
                               , const PublicKey& pubkey)
 {
     return add_user(username,
                     pubkey,
-                    _delegate->participants(),
-                    _delegate->invitees());
+                    _state.participants,
+                    _state.invitees);
 }
 
-inline User& Channel::add_user( const std::string& username
+inline User& Channel::add_user( const Name& username
                               , const PublicKey& pubkey
                               , const std::set<std::string>& participants
                               , const std::set<std::string>& invitees)
 {
-    assert(_users.count(username) == 0);
+    auto i = _users.emplace(username, nullptr);
+
+    NP1SEC_CHECK(i.second && "User is already in the channel");
+    if (!i.second) return *i.first->second;
 
     auto u = new User(*this, username, pubkey);
-    auto i = _users.emplace(username, std::unique_ptr<User>(u));
+    i.first->second.reset(u);
 
-    if (participants.count(username)) {
+    if (participants.count(username.str())) {
         u->mark_joined();
     }
 
-    if (invitees.count(username)) {
+    if (invitees.count(username.str())) {
         u->mark_as_invited();
     }
 
-    if (username == my_username() && _delegate->in_chat()) {
+    if (username == _room.my_name() && _state.in_chat) {
         u->mark_in_chat();
     }
 
     return *(i.first->second.get());
 }
 
-inline void Channel::remove_user(const std::string& username)
+inline void Channel::remove_users(const std::vector<Name>& usernames)
 {
-    _users.erase(username);
+    if (_channel_view && usernames.size() > 1) {
+        _channel_view->batch_user_list_updates();
+    }
+
+    for (const auto& u : usernames) {
+        _users.erase(u);
+        _bulk_invitees.erase(u);
+    }
 
     if (_users.empty()) {
         return self_destruct();
@@ -315,45 +535,55 @@ inline void Channel::remove_user(const std::string& username)
 inline
 void Channel::user_joined(const std::string& username)
 {
-    inform("Channel::user_joined(", username, ")");
+    ui_post([this, username] {
+        inform("Channel::user_joined(", username, ")");
 
-    auto ui = _users.find(username);
+        auto ui = _users.find(_room.find_name(username));
 
-    assert(ui != _users.end());
+        NP1SEC_CHECK(ui != _users.end());
 
-    if (ui == _users.end()) {
-        return inform("Unknown user \"", username, "\" joine channel");
-    }
+        if (ui == _users.end()) {
+            return inform("Unknown user \"", username, "\" joine channel");
+        }
 
-    ui->second->mark_joined();
+        ui->second->mark_joined();
+    });
 }
 
 inline
 void Channel::user_left(const std::string& username)
 {
-    inform("Channel::user_left(", username, ")");
+    ui_post([this, username] {
+        inform("Channel::user_left(", username, ")");
 
-    if (auto u = find_user(username)) {
-        u->mark_not_joined();
-    }
+        if (auto u = find_user(username)) {
+            u->mark_not_joined();
+        }
+    });
 }
 
 inline
 void Channel::votekick_registered(const std::string& kicker, const std::string& victim, bool kicked)
 {
-    inform("Channel::votekick_registered(", kicker, " ", victim, " ", kicked);
+    ui_post([this, kicker, victim, kicked] {
+        inform("Channel::votekick_registered(", kicker, " ", victim, " ", kicked);
+    });
 }
 
 inline
 void Channel::user_authenticated(const std::string& username, const PublicKey& public_key)
 {
-    inform("TODO: Channel::user_authenticated(", username, ")");
+    ui_post([this, username] {
+        inform("TODO: Channel::user_authenticated(", username, ")");
+    });
 }
 
 inline
 void Channel::user_authentication_failed(const std::string& username)
 {
-    inform("Channel::user_authentication_failed(", username, ")");
+    ui_post([this, username] {
+        inform("Channel::user_authentication_failed(", username, ")");
+    });
 }
 
 inline void Channel::joined()
@@ -367,64 +597,103 @@ template<class... Args>
 inline
 void Channel::inform(Args&&... args)
 {
-    log(this, " Channel: ", util::str(args...));
-    _channel_view->display(my_username(), util::inform_str(args...));
+    auto text = util::str(args...);
+    log(this, " Channel: ", text);
+    _room._events.push(util::str("[", channel_name(), "] ", text));
+}
+
+template<class... Args>
+inline
+void Channel::respond(Args&&... args)
+{
+    /* Before create_view() there's nowhere to show it. */
+    if (!_channel_view) return inform(args...);
+    _channel_view->inform(args...);
 }
 
 inline
 void Channel::message_received(const std::string& username, const std::string& message)
 {
-    _channel_view->display(username, message);
+    ui_post([this, username, message] {
+        if (_channel_view) _channel_view->display(username, message);
+    });
 }
 
 inline
 void Channel::user_joined_chat(const std::string& username)
 {
-    inform("Channel::user_joined_chat(", username, ")");
-    if (auto u = find_user(username)) {
-        u->mark_in_chat();
-    }
+    ui_post([this, username] {
+        inform("Channel::user_joined_chat(", username, ")");
+        if (auto u = find_user(username)) {
+            u->mark_in_chat();
+        }
+    });
 }
 
 inline
 void Channel::joined_chat()
 {
-    inform("Channel::joined_chat()");
-
     /* Can't just mark myself as being in chat and call it a day because
      * only now I can determine whether other participants are in
      * chat or not. */
+    std::set<std::string> in_chat;
+
     for (const auto& p : _delegate->participants()) {
-        auto u = find_user(p);
-        assert(u);
-        if (u && _delegate->participant_in_chat(p)) {
-            u->mark_in_chat();
+        if (_delegate->participant_in_chat(p)) {
+            in_chat.insert(p);
         }
     }
+
+    ui_post([this, in_chat] {
+        inform("Channel::joined_chat()");
+
+        for (const auto& p : in_chat) {
+            auto u = find_user(p);
+            NP1SEC_CHECK(u);
+            if (u) u->mark_in_chat();
+        }
+    });
 }
 
+/*
+ * Called on the np1sec thread. Forget the conversation before posting:
+ * without a worker thread the posted function runs (and destroys this
+ * channel) right away, with one np1sec may destroy the conversation
+ * before it runs.
+ */
 inline void Channel::left()
 {
-    inform("Channel::left()");
-    if (auto u = find_user(my_username())) {
-        if (_channel_view && u->never_joined()) {
-            _channel_view->close_window();
+    _left     = true;
+    _delegate = nullptr;
+
+    ui_post([this] {
+        inform("Channel::left()");
+        if (auto u = find_user(_room.my_name())) {
+            if (_channel_view && u->never_joined()) {
+                _channel_view->close_window();
+            }
         }
-    }
-    self_destruct();
+        self_destruct();
+    });
 }
 
 inline
-User* Channel::find_user(const std::string& user) {
+User* Channel::find_user(const Name& user) {
     auto user_i = _users.find(user);
     if (user_i == _users.end()) return nullptr;
     return user_i->second.get();
 }
 
-const User* Channel::find_user(const std::string& user) const {
+inline
+const User* Channel::find_user(const Name& user) const {
     auto user_i = _users.find(user);
     if (user_i == _users.end()) return nullptr;
     return user_i->second.get();
 }
 
+inline
+User* Channel::find_user(boost::string_ref user) {
+    return find_user(_room.find_name(user));
+}
+
 } // np1sec_plugin namespace
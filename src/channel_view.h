@@ -20,8 +20,10 @@
 
 #include <pidgin/gtkimhtml.h>
 #include <pidgin/gtkutils.h>
-#include "user_list.h"
+#include "channel_widgets.h"
+#include "check.h"
 #include "global_signals.h"
+#include "display_queue.h"
 
 namespace np1sec_plugin {
 
@@ -37,9 +39,9 @@ public:
 
     template<class... Args> void inform(Args&&...);
 
-    UserList& joined_user_list() { return _joined_users; }
-    UserList& invited_user_list() { return _invited_users; }
-    UserList& other_user_list() { return _other_users; }
+    UserList& joined_user_list() { return _widgets->joined; }
+    UserList& invited_user_list() { return _widgets->invited; }
+    UserList& other_user_list() { return _widgets->other; }
 
     Channel* channel() { return _channel; }
     void reset_channel() { _channel = nullptr; }
@@ -48,6 +50,12 @@ public:
 
     void close_window();
 
+    /* Freeze the user lists until the end of this main loop iteration,
+     * so a burst of membership changes causes a single relayout. */
+    void batch_user_list_updates();
+
+    DisplayQueue& display_queue() { return _display_queue; }
+
 private:
     static gboolean
     entry_focus_cb(GtkWidget*, GdkEventFocus*, ChannelView* self);
@@ -57,18 +65,27 @@ private:
 
     void disconnect_focus_signals(PurpleConversation* conv);
 
+    /* Put Pidgin's user list back in place of ours. */
+    void restore_user_list();
+
+    static gboolean on_thaw_user_lists(gpointer);
+    void thaw_user_lists();
+
 private:
     std::shared_ptr<Room> _room;
     Channel* _channel;
     PurpleConversation* _conv;
     PidginConversation* _gtkconv;
 
-    UserList _joined_users;
-    UserList _invited_users;
-    UserList _other_users;
+    std::unique_ptr<ChannelWidgets> _widgets;
+
+    DisplayQueue _display_queue;
+
+    guint _thaw_source_id = 0;
 
     gint focus_in_signal_id, focus_out_signal_id;
-    GtkWidget *_target, *_userlist, *_vbox;
+    GtkWidget* _target = nullptr;
+    GtkWidget* _userlist = nullptr;
 };
 
 } // np1sec_plugin namespace
@@ -92,7 +109,7 @@ inline void set_channel_view(PurpleConversation* conv, ChannelView* cv) {
 inline
 void ChannelView::send_chat_message(const std::string& msg)
 {
-    assert(_channel);
+    NP1SEC_CHECK(_channel);
     _channel->send_chat_message(msg);
 }
 
@@ -100,13 +117,13 @@ inline
 ChannelView::ChannelView(const std::shared_ptr<Room>& room, Channel& channel)
     : _room(room)
     , _channel(&channel)
-    , _joined_users("Joined")
-    , _invited_users("Invited")
-    , _other_users("Invite")
 {
-    assert(_room->get_view());
+    NP1SEC_CHECK(_room->get_view());
     auto conv = _room->get_view()->purple_conv();
 
+    /* Usually prepared while the UI was idle. */
+    _widgets = _room->get_view()->take_channel_widgets();
+
     auto channel_name = _room->room_name() + ":" + channel.channel_name();
 
     // We don't want the on_conversation_created signal to create the default
@@ -120,6 +137,8 @@ ChannelView::ChannelView(const std::shared_ptr<Room>& room, Channel& channel)
     }
 
     _gtkconv = PIDGIN_CONVERSATION(_conv);
+    _display_queue.set_conversation(_conv);
+    _display_queue.set_held(_room->display_held());
 
     //gtk_notebook_set_current_page(GTK_NOTEBOOK(_gtkconv->win->notebook), -1);
 
@@ -137,31 +156,20 @@ ChannelView::ChannelView(const std::shared_ptr<Room>& room, Channel& channel)
 
     _target = util::gtk::get_nth_child(output_window_position, GTK_CONTAINER(content));
 
-    assert(GTK_IS_PANED(_target));
-
-    if (!_target) {
-        assert(_target);
-        return;
-    }
+    NP1SEC_CHECK(GTK_IS_PANED(_target));
+    if (!_target) return;
 
     _userlist = gtk_paned_get_child2(GTK_PANED(_target));
     g_object_ref_sink(_userlist);
 
     gtk_container_remove(GTK_CONTAINER(_target), _userlist);
 
-    _vbox = gtk_vbox_new(TRUE, 0);
-
-    gtk_box_pack_start(GTK_BOX(_vbox), _joined_users.root_widget(), TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(_vbox), _invited_users.root_widget(), TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(_vbox), _other_users.root_widget(), TRUE, TRUE, 0);
-
-    gtk_paned_pack2(GTK_PANED(_target), _vbox, FALSE, TRUE);
-    gtk_widget_show(_vbox);
+    gtk_paned_pack2(GTK_PANED(_target), _widgets->vbox, FALSE, TRUE);
 
     {
         gint width, height;
         gtk_widget_get_size_request(_userlist, &width, &height);
-        gtk_widget_set_size_request(_vbox, width, height);
+        gtk_widget_set_size_request(_widgets->vbox, width, height);
     }
 
     set_channel_view(_conv, this);
@@ -183,29 +191,88 @@ void ChannelView::close_window()
     auto conv = _conv;
     _conv = nullptr;
 
+    _display_queue.clear();
+    _display_queue.set_conversation(nullptr);
+
     disconnect_focus_signals(conv);
 
-    auto& sigs = GlobalSignals::instance();
-    auto f = std::move(sigs.on_conversation_deleted);
+    /* Keep our widgets out of the destruction, so they can be reused. */
+    restore_user_list();
+
+    /* With this unset, the plugin's deleting-conversation handler leaves
+     * us alone but still forgets the conversation. */
+    set_channel_view(conv, nullptr);
     purple_conversation_destroy(conv);
-    sigs.on_conversation_deleted = std::move(f);
+}
+
+inline
+void ChannelView::restore_user_list()
+{
+    if (!_userlist) return;
+
+    gtk_container_remove(GTK_CONTAINER(_target), _widgets->vbox);
+    gtk_paned_pack2(GTK_PANED(_target), _userlist, FALSE, TRUE);
+    g_object_unref(_userlist);
+    _userlist = nullptr;
+}
+
+inline
+void ChannelView::batch_user_list_updates()
+{
+    if (_thaw_source_id) return;
+
+    _widgets->joined.freeze();
+    _widgets->invited.freeze();
+    _widgets->other.freeze();
+
+    _thaw_source_id = g_idle_add(on_thaw_user_lists, this);
+}
+
+inline
+gboolean ChannelView::on_thaw_user_lists(gpointer data)
+{
+    auto self = reinterpret_cast<ChannelView*>(data);
+    self->_thaw_source_id = 0;
+    self->thaw_user_lists();
+    // Returning FALSE removes the idle source.
+    return FALSE;
+}
+
+inline
+void ChannelView::thaw_user_lists()
+{
+    _widgets->joined.thaw();
+    _widgets->invited.thaw();
+    _widgets->other.thaw();
 }
 
 inline
 ChannelView::~ChannelView()
 {
+    if (_thaw_source_id) {
+        g_source_remove(_thaw_source_id);
+        thaw_user_lists();
+    }
+
     if (_channel) {
-        assert(!_channel->_channel_view || _channel->_channel_view == this);
+        NP1SEC_CHECK(!_channel->_channel_view || _channel->_channel_view == this);
     }
 
     if (_conv) {
         disconnect_focus_signals(_conv);
-        gtk_container_remove(GTK_CONTAINER(_target), _vbox);
-        gtk_paned_pack2(GTK_PANED(_target), _userlist, FALSE, TRUE);
-        g_object_unref(_userlist);
+        restore_user_list();
         set_channel_view(_conv, nullptr);
     }
 
+    /* Our widgets are only still inside Pidgin's if Pidgin destroyed
+     * them, in which case they can't be reused. The reset also detaches
+     * the channel's users from the lists. */
+    if (!_userlist) {
+        if (auto room_view = _room->get_view()) {
+            room_view->recycle_channel_widgets(std::move(_widgets));
+        }
+    }
+
     /* Note: we don't want to explicitly call close_window (or
      * purple_conversation_destroy) because in most cases it'll be
      * called implicitly from pidgin (e.g. when the user closes the
@@ -227,21 +294,15 @@ template<class... Args>
 inline
 void ChannelView::inform(Args&&... args)
 {
-    assert(_channel);
-    display(_channel->my_username(), util::inform_str(args...));
+    NP1SEC_CHECK(_channel);
+    _display_queue.push_notice(_channel->my_username(), util::inform_str(args...));
 }
 
 inline
 void ChannelView::display(const std::string& sender, const std::string& message)
 {
     if (!_conv) return;
-
-    _conv->ui_ops->write_conv(_conv,
-                              sender.c_str(),
-                              sender.c_str(),
-                              message.c_str(),
-                              PURPLE_MESSAGE_RECV,
-                              time(NULL));
+    _display_queue.push(sender, message);
 }
 
 inline gboolean
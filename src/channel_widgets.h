@@ -0,0 +1,217 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "user_list.h"
+#include "util.h"
+
+namespace np1sec_plugin {
+
+/*
+ * What a ChannelView puts in place of Pidgin's user list: the joined,
+ * invited and invite lists stacked in a vbox. None of it depends on the
+ * conversation, so it can be built before the channel exists.
+ */
+struct ChannelWidgets {
+    ChannelWidgets(const std::shared_ptr<UserModel>&);
+    ~ChannelWidgets();
+
+    ChannelWidgets(const ChannelWidgets&) = delete;
+    ChannelWidgets& operator=(const ChannelWidgets&) = delete;
+
+    /* Back to the state of a newly built set, the users' rows stay in
+     * the model only if other lists show them. The vbox must not be
+     * inside any container. */
+    void reset();
+
+    UserList joined;
+    UserList invited;
+    UserList other;
+
+    GtkWidget* vbox;
+};
+
+/*
+ * Keeps a few ChannelWidgets ready so that opening a channel only has to
+ * create the conversation and bind them. Widgets of closed channels are
+ * reset and kept for the next channel, up to capacity sets. If there are
+ * fewer than spares ready, new ones are built one per low priority idle
+ * callback, so a burst of new channels uses up the spares and the rest
+ * are built while the UI is otherwise idle.
+ */
+class ChannelWidgetsPool {
+public:
+    static const size_t default_spares   = 2;
+    static const size_t default_capacity = 8;
+
+    struct Stats {
+        size_t taken    = 0;  // Sets handed out
+        size_t hits     = 0;  // ... of which were ready
+        size_t recycled = 0;  // Sets given back and kept
+        size_t dropped  = 0;  // Sets given back while the pool was full
+    };
+
+public:
+    ChannelWidgetsPool( std::shared_ptr<UserModel>
+                      , size_t spares   = default_spares
+                      , size_t capacity = default_capacity);
+    ~ChannelWidgetsPool();
+
+    ChannelWidgetsPool(const ChannelWidgetsPool&) = delete;
+    ChannelWidgetsPool& operator=(const ChannelWidgetsPool&) = delete;
+
+    /* A ready set if there is one, otherwise built right away. */
+    std::unique_ptr<ChannelWidgets> take();
+
+    /* Return a set no longer shown anywhere. */
+    void recycle(std::unique_ptr<ChannelWidgets>);
+
+    const Stats& stats() const { return _stats; }
+    std::string stats_info() const;
+
+private:
+    void refill();
+    static gboolean on_idle(gpointer);
+
+private:
+    std::shared_ptr<UserModel> _model;
+    size_t _spares;
+    size_t _capacity;
+    std::vector<std::unique_ptr<ChannelWidgets>> _ready;
+    guint _source_id = 0;
+    Stats _stats;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline ChannelWidgets::ChannelWidgets(const std::shared_ptr<UserModel>& model)
+    : joined("Joined", model)
+    , invited("Invited", model)
+    , other("Invite", model, UserList::Options{true, true})
+{
+    /* Keep our own reference, the vbox is moved in and out of Pidgin's
+     * paned. */
+    vbox = gtk_vbox_new(TRUE, 0);
+    g_object_ref_sink(vbox);
+
+    gtk_box_pack_start(GTK_BOX(vbox), joined.root_widget(), TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), invited.root_widget(), TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), other.root_widget(), TRUE, TRUE, 0);
+
+    gtk_widget_show(vbox);
+}
+
+inline ChannelWidgets::~ChannelWidgets()
+{
+    g_object_unref(vbox);
+}
+
+inline void ChannelWidgets::reset()
+{
+    NP1SEC_CHECK(!gtk_widget_get_parent(vbox));
+
+    joined.reset();
+    invited.reset();
+    other.reset();
+
+    gtk_widget_set_size_request(vbox, -1, -1);
+}
+
+//------------------------------------------------------------------------------
+inline ChannelWidgetsPool::ChannelWidgetsPool( std::shared_ptr<UserModel> model
+                                             , size_t spares
+                                             , size_t capacity)
+    : _model(std::move(model))
+    , _spares(spares)
+    , _capacity(std::max(spares, capacity))
+{
+    refill();
+}
+
+inline ChannelWidgetsPool::~ChannelWidgetsPool()
+{
+    if (_source_id) g_source_remove(_source_id);
+}
+
+inline std::unique_ptr<ChannelWidgets> ChannelWidgetsPool::take()
+{
+    std::unique_ptr<ChannelWidgets> result;
+
+    ++_stats.taken;
+
+    if (_ready.empty()) {
+        result.reset(new ChannelWidgets(_model));
+    }
+    else {
+        ++_stats.hits;
+        result = std::move(_ready.back());
+        _ready.pop_back();
+    }
+
+    refill();
+    return result;
+}
+
+inline void ChannelWidgetsPool::recycle(std::unique_ptr<ChannelWidgets> w)
+{
+    if (_ready.size() >= _capacity) {
+        ++_stats.dropped;
+        return;
+    }
+
+    ++_stats.recycled;
+    w->reset();
+    _ready.push_back(std::move(w));
+}
+
+inline std::string ChannelWidgetsPool::stats_info() const
+{
+    auto hit_rate = _stats.taken ? 100 * _stats.hits / _stats.taken : 100;
+
+    return util::str(_stats.taken, " taken, ", _stats.hits, " ready (",
+                     hit_rate, "%), ", _stats.recycled, " recycled, ",
+                     _stats.dropped, " dropped, ", _ready.size(), " pooled");
+}
+
+inline void ChannelWidgetsPool::refill()
+{
+    if (_source_id || _ready.size() >= _spares) return;
+    _source_id = g_idle_add_full(G_PRIORITY_LOW, on_idle, this, NULL);
+}
+
+inline gboolean ChannelWidgetsPool::on_idle(gpointer data)
+{
+    auto self = reinterpret_cast<ChannelWidgetsPool*>(data);
+
+    /* Recycled sets may have filled the pool in the meantime. */
+    if (self->_ready.size() < self->_spares) {
+        self->_ready.emplace_back(new ChannelWidgets(self->_model));
+    }
+
+    if (self->_ready.size() < self->_spares) return TRUE;
+
+    self->_source_id = 0;
+    // Returning FALSE removes the idle source.
+    return FALSE;
+}
+
+} // np1sec_plugin namespace
@@ -0,0 +1,102 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * Invariant checks whose cost depends on the build's check policy,
+ * selected with NP1SEC_CHECKS (see the CHECKS option in CMakeLists.txt):
+ *
+ *   checked (1): cheap and expensive checks, a failure prints the check
+ *                and aborts. The default unless NDEBUG is defined.
+ *   release (0): cheap checks only, a failure is printed and the code
+ *                carries on with its own error handling. Expensive checks
+ *                are still compiled (so they can't rot) but never run.
+ *   fuzz    (2): cheap and expensive checks, a failure traps right away
+ *                so the fuzzer sees one crash per check.
+ *
+ * NP1SEC_CHECK is for conditions costing about as much as the code
+ * around them (a comparison, a flag). NP1SEC_CHECK_EXPENSIVE is for
+ * checks that search or walk data structures the code itself doesn't
+ * need to.
+ */
+#ifndef NP1SEC_CHECKS
+#  ifdef NDEBUG
+#    define NP1SEC_CHECKS 0
+#  else
+#    define NP1SEC_CHECKS 1
+#  endif
+#endif
+
+namespace np1sec_plugin {
+namespace check {
+
+struct ReleasePolicy {
+    static constexpr bool cheap     = true;
+    static constexpr bool expensive = false;
+
+    static void fail(const char* condition, const char* file, int line) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+    }
+};
+
+struct CheckedPolicy {
+    static constexpr bool cheap     = true;
+    static constexpr bool expensive = true;
+
+    static void fail(const char* condition, const char* file, int line) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, condition);
+        abort();
+    }
+};
+
+struct FuzzPolicy {
+    static constexpr bool cheap     = true;
+    static constexpr bool expensive = true;
+
+    static void fail(const char*, const char*, int) {
+        __builtin_trap();
+    }
+};
+
+#if NP1SEC_CHECKS == 0
+using Policy = ReleasePolicy;
+#elif NP1SEC_CHECKS == 1
+using Policy = CheckedPolicy;
+#elif NP1SEC_CHECKS == 2
+using Policy = FuzzPolicy;
+#else
+#  error "NP1SEC_CHECKS must be 0 (release), 1 (checked) or 2 (fuzz)"
+#endif
+
+} // check namespace
+} // np1sec_plugin namespace
+
+#define NP1SEC_CHECK_WITH(enabled, condition)                               \
+    ((!(enabled) || (condition))                                            \
+        ? (void) 0                                                          \
+        : ::np1sec_plugin::check::Policy::fail(#condition, __FILE__, __LINE__))
+
+#define NP1SEC_CHECK(condition) \
+    NP1SEC_CHECK_WITH(::np1sec_plugin::check::Policy::cheap, condition)
+
+#define NP1SEC_CHECK_EXPENSIVE(condition) \
+    NP1SEC_CHECK_WITH(::np1sec_plugin::check::Policy::expensive, condition)
@@ -0,0 +1,207 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include "parser.h"
+#include "util.h"
+
+namespace np1sec_plugin {
+
+namespace command_detail {
+    /* FNV-1a, usable both at compile time and on a string_ref. */
+    constexpr uint32_t hash(const char* s, uint32_t h = 2166136261u) {
+        return *s ? hash(s + 1, (h ^ uint8_t(*s)) * 16777619u) : h;
+    }
+
+    inline uint32_t hash(boost::string_ref s) {
+        uint32_t h = 2166136261u;
+        for (char c : s) h = (h ^ uint8_t(c)) * 16777619u;
+        return h;
+    }
+} // command_detail namespace
+
+/*
+ * Arguments of a command, referencing the command line.
+ */
+class CommandArgs {
+public:
+    using parse_error = Parser::parse_error;
+
+    CommandArgs(boost::string_ref text);
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    boost::string_ref word(size_t i) const;
+    size_t number(size_t i) const;
+
+    template<class F> void for_each(F&& f) const;
+
+private:
+    boost::string_ref _text;
+    size_t _size = 0;
+};
+
+/*
+ * An entry in a command table. The handler is only invoked with an
+ * argument count within [min_args, max_args].
+ */
+template<class Target>
+struct Command {
+    using Handler = void (Target::*)(const CommandArgs&);
+
+    static constexpr size_t unlimited = std::numeric_limits<size_t>::max();
+
+    const char* name;
+    const char* usage;
+    size_t min_args;
+    size_t max_args;
+    Handler handler;
+    uint32_t hash;
+
+    constexpr Command( const char* name
+                     , const char* usage
+                     , size_t min_args
+                     , size_t max_args
+                     , Handler handler)
+        : name(name)
+        , usage(usage)
+        , min_args(min_args)
+        , max_args(max_args)
+        , handler(handler)
+        , hash(command_detail::hash(name))
+    {}
+};
+
+template<class Target, size_t N>
+std::string command_help(const Command<Target> (&table)[N]);
+
+/*
+ * Find the command named by the first word of the line and invoke it.
+ * Every table implicitly has a "help" command listing its entries.
+ * Errors are reported through target.respond.
+ */
+template<class Target, size_t N>
+void dispatch_command( const Command<Target> (&table)[N]
+                     , Target& target
+                     , boost::string_ref line)
+{
+    Parser p(line);
+
+    if (p.at_end()) return;
+
+    auto name = p.read_word();
+
+    if (name == "help") {
+        return target.respond(command_help(table));
+    }
+
+    auto h = command_detail::hash(name);
+
+    for (const auto& c : table) {
+        if (c.hash != h || name != c.name) continue;
+
+        CommandArgs args(p.rest());
+
+        if (args.size() < c.min_args || args.size() > c.max_args) {
+            return target.respond("Usage: ", c.name, " ", c.usage);
+        }
+
+        try {
+            (target.*c.handler)(args);
+        }
+        catch (const std::exception& e) {
+            target.respond(c.name, ": ", e.what());
+        }
+        return;
+    }
+
+    target.respond("\"", line, "\" is not a valid np1sec command");
+}
+
+/* The help text listing all commands in the table. */
+template<class Target, size_t N>
+std::string command_help(const Command<Target> (&table)[N])
+{
+    std::string result = "<br>Available commands:<br>"
+                         "&nbsp;&nbsp;&nbsp;&nbsp;help<br>";
+
+    for (const auto& c : table) {
+        result += util::str("&nbsp;&nbsp;&nbsp;&nbsp;", c.name, " ", c.usage, "<br>");
+    }
+
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline CommandArgs::CommandArgs(boost::string_ref text)
+    : _text(text)
+{
+    for_each([this] (boost::string_ref) { ++_size; });
+}
+
+template<class F>
+inline void CommandArgs::for_each(F&& f) const
+{
+    Parser p(_text);
+    while (!p.at_end()) f(p.read_word());
+}
+
+inline boost::string_ref CommandArgs::word(size_t i) const
+{
+    Parser p(_text);
+
+    while (!p.at_end()) {
+        auto w = p.read_word();
+        if (i-- == 0) return w;
+    }
+
+    throw parse_error("missing argument");
+}
+
+inline size_t CommandArgs::number(size_t i) const
+{
+    auto w = word(i);
+
+    if (w.empty()) throw parse_error("expected a number");
+
+    size_t result = 0;
+
+    for (char c : w) {
+        if (c < '0' || c > '9') {
+            throw parse_error(util::str("\"", w, "\" is not a number"));
+        }
+
+        auto digit = size_t(c - '0');
+
+        if (result > (std::numeric_limits<size_t>::max() - digit) / 10) {
+            throw parse_error(util::str("\"", w, "\" is too large"));
+        }
+
+        result = result * 10 + digit;
+    }
+
+    return result;
+}
+
+} // np1sec_plugin namespace
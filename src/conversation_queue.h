@@ -0,0 +1,221 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <libpurple/debug.h>
+#include "log.h"
+
+namespace np1sec_plugin {
+
+/*
+ * Applies a step (e.g. enabling np1sec) to a list of conversations, one
+ * conversation per low priority idle callback, so that Pidgin keeps
+ * drawing and handling input in between. Conversations are processed in
+ * the order they were pushed, callers put the ones the user is looking
+ * at first.
+ *
+ * Conversations must be removed when they are deleted before their turn
+ * (the "deleting-conversation" signal), a later one may get the same
+ * address. When everything is done, the number of conversations and the
+ * total and longest step times are written to the debug log.
+ */
+class ConversationQueue {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    using Step = std::function<void(PurpleConversation*)>;
+
+    ConversationQueue(std::string name, Step step);
+    ~ConversationQueue();
+
+    ConversationQueue(const ConversationQueue&) = delete;
+    ConversationQueue& operator=(const ConversationQueue&) = delete;
+
+    void push(PurpleConversation*);
+
+    /* Drop the conversation if it hasn't been processed yet. */
+    void remove(PurpleConversation*);
+
+    /* Start processing from idle callbacks. */
+    void start();
+
+    /* Process whatever is left right now. Calls on_done unless that has
+     * already happened or the queue was cancelled. */
+    void finish();
+
+    /* Forget the remaining conversations without processing them. */
+    void cancel();
+
+    bool empty() const { return _queue.empty(); }
+
+    /* Called once the queue has been emptied by processing it (or by
+     * removing the rest). */
+    std::function<void()> on_done;
+
+private:
+    static gboolean on_idle(gpointer);
+
+    void reset_stats();
+    void run_one();
+    void done();
+
+private:
+    std::string _name;
+    Step _step;
+    std::deque<PurpleConversation*> _queue;
+    guint _source_id = 0;
+
+    enum class State { idle, running, finished };
+    State _state = State::idle;
+
+    Clock::time_point _start;
+    size_t _count = 0;
+    Clock::duration _busy;
+    Clock::duration _longest;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline ConversationQueue::ConversationQueue(std::string name, Step step)
+    : _name(std::move(name))
+    , _step(std::move(step))
+{
+}
+
+inline ConversationQueue::~ConversationQueue()
+{
+    if (_source_id) g_source_remove(_source_id);
+}
+
+inline void ConversationQueue::push(PurpleConversation* conv)
+{
+    _queue.push_back(conv);
+}
+
+inline void ConversationQueue::remove(PurpleConversation* conv)
+{
+    _queue.erase(std::remove(_queue.begin(), _queue.end(), conv), _queue.end());
+}
+
+inline void ConversationQueue::start()
+{
+    reset_stats();
+    _state = State::running;
+
+    if (_queue.empty()) return done();
+
+    if (!_source_id) {
+        _source_id = g_idle_add_full(G_PRIORITY_LOW, on_idle, this, NULL);
+    }
+}
+
+inline void ConversationQueue::finish()
+{
+    if (_state == State::finished) return;
+
+    /* Never started, e.g. unloading while Pidgin quits. */
+    if (_state == State::idle) reset_stats();
+
+    if (_source_id) {
+        g_source_remove(_source_id);
+        _source_id = 0;
+    }
+
+    while (!_queue.empty()) run_one();
+
+    done();
+}
+
+inline void ConversationQueue::cancel()
+{
+    if (_source_id) {
+        g_source_remove(_source_id);
+        _source_id = 0;
+    }
+
+    _queue.clear();
+    _state = State::finished;
+}
+
+inline gboolean ConversationQueue::on_idle(gpointer data)
+{
+    auto self = reinterpret_cast<ConversationQueue*>(data);
+
+    /* remove() may have taken the last ones. */
+    if (!self->_queue.empty()) self->run_one();
+
+    if (!self->_queue.empty()) return TRUE;
+
+    self->_source_id = 0;
+    self->done();
+
+    // Returning FALSE removes the idle source.
+    return FALSE;
+}
+
+inline void ConversationQueue::reset_stats()
+{
+    _start   = Clock::now();
+    _count   = 0;
+    _busy    = Clock::duration::zero();
+    _longest = Clock::duration::zero();
+}
+
+inline void ConversationQueue::run_one()
+{
+    auto conv = _queue.front();
+    _queue.pop_front();
+
+    auto start = Clock::now();
+    _step(conv);
+    auto duration = Clock::now() - start;
+
+    ++_count;
+    _busy += duration;
+    _longest = std::max(_longest, duration);
+}
+
+inline void ConversationQueue::done()
+{
+    using namespace std::chrono;
+
+    auto ms = [] (Clock::duration d) { return duration_cast<milliseconds>(d).count(); };
+
+    auto summary = util::str(_name, ": ", _count, " conversation(s) in ",
+                             ms(Clock::now() - _start), "ms (busy ",
+                             ms(_busy), "ms, longest ", ms(_longest), "ms)");
+
+    purple_debug_info("np1sec", "%s\n", summary.c_str());
+    log(summary);
+
+    _state = State::finished;
+
+    if (on_done) {
+        auto f = on_done;
+        f();
+    }
+}
+
+} // np1sec_plugin namespace
@@ -0,0 +1,291 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include "util.h"
+
+namespace np1sec_plugin {
+
+/*
+ * Collects lines displayed in a conversation during one main loop
+ * iteration and writes them out from a single idle callback, one
+ * write_conv call per line, before GTK gets to lay them out.
+ *
+ * Chat messages are always kept. Of our own notices (command replies
+ * and the like) at most max_backlog are kept, older ones are dropped
+ * and replaced by a note saying how many were lost.
+ *
+ * After each flush the conversation's scrollback is trimmed to the
+ * scrollback limit (in lines, 0 means unlimited). To avoid deleting a
+ * line on every write, trimming only starts once the limit is exceeded
+ * by a tenth.
+ */
+class DisplayQueue {
+public:
+    static const size_t max_backlog = 1000;
+
+    /* Overridden by the NP1SEC_TEST_CLIENT_SCROLLBACK environment
+     * variable. */
+    static const size_t default_scrollback_limit = 5000;
+
+    static size_t scrollback_limit_from_env();
+
+public:
+    DisplayQueue() = default;
+    ~DisplayQueue();
+
+    DisplayQueue(const DisplayQueue&) = delete;
+    DisplayQueue& operator=(const DisplayQueue&) = delete;
+
+    void set_conversation(PurpleConversation* conv) { _conv = conv; }
+
+    void set_scrollback_limit(size_t lines);
+    size_t scrollback_limit() const { return _scrollback_limit; }
+
+    /* Human readable scrollback size and memory estimate. */
+    std::string scrollback_info() const;
+
+    /* A chat message, never dropped. */
+    void push(const std::string& sender, const std::string& message);
+
+    /* Text of our own, dropped if too many pile up. */
+    void push_notice(const std::string& sender, const std::string& message);
+
+    /* Write out everything pending right now. */
+    void flush();
+
+    /* Discard everything pending. */
+    void clear();
+
+    /* While held, lines are only collected and written out once the
+     * queue is released. */
+    void set_held(bool);
+
+private:
+    struct Line {
+        std::string sender;
+        std::string message;
+        time_t time;
+        bool notice;
+    };
+
+    void push(Line);
+    static gboolean on_idle(gpointer);
+
+    void write(const std::string& sender, const std::string& message, time_t);
+    void trim();
+
+    GtkIMHtml* imhtml() const;
+
+private:
+    PurpleConversation* _conv = nullptr;
+    size_t _scrollback_limit = scrollback_limit_from_env();
+    std::deque<Line> _lines;
+    size_t _notices = 0;
+    size_t _dropped = 0;
+    guint _source_id = 0;
+    bool _held = false;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline DisplayQueue::~DisplayQueue()
+{
+    clear();
+}
+
+inline
+void DisplayQueue::push(const std::string& sender, const std::string& message)
+{
+    push(Line{sender, message, time(NULL), false});
+}
+
+inline
+void DisplayQueue::push_notice(const std::string& sender, const std::string& message)
+{
+    push(Line{sender, message, time(NULL), true});
+}
+
+inline void DisplayQueue::push(Line line)
+{
+    if (!_conv) return;
+
+    if (line.notice && _notices == max_backlog) {
+        auto oldest = std::find_if(_lines.begin(), _lines.end(),
+                                   [] (const Line& l) { return l.notice; });
+        _lines.erase(oldest);
+        --_notices;
+        ++_dropped;
+    }
+
+    if (line.notice) ++_notices;
+    _lines.push_back(std::move(line));
+
+    if (!_source_id && !_held) {
+        /* Higher than the redraw priority so the whole batch is written
+         * before GTK gets to lay it out. */
+        _source_id = g_idle_add_full(G_PRIORITY_HIGH_IDLE, on_idle, this, NULL);
+    }
+}
+
+inline void DisplayQueue::set_held(bool held)
+{
+    _held = held;
+
+    if (_held) {
+        if (_source_id) {
+            g_source_remove(_source_id);
+            _source_id = 0;
+        }
+    }
+    else if (!_lines.empty() && !_source_id) {
+        _source_id = g_idle_add_full(G_PRIORITY_HIGH_IDLE, on_idle, this, NULL);
+    }
+}
+
+inline void DisplayQueue::clear()
+{
+    if (_source_id) {
+        g_source_remove(_source_id);
+        _source_id = 0;
+    }
+
+    _lines.clear();
+    _notices = 0;
+    _dropped = 0;
+}
+
+inline gboolean DisplayQueue::on_idle(gpointer data)
+{
+    auto self = reinterpret_cast<DisplayQueue*>(data);
+    self->_source_id = 0;
+    self->flush();
+    // Returning FALSE removes the idle source.
+    return FALSE;
+}
+
+inline void DisplayQueue::flush()
+{
+    if (_source_id) {
+        g_source_remove(_source_id);
+        _source_id = 0;
+    }
+
+    auto lines = std::move(_lines);
+    auto dropped = _dropped;
+
+    _lines.clear();
+    _notices = 0;
+    _dropped = 0;
+
+    if (!_conv || lines.empty()) return;
+
+    if (dropped) {
+        const auto& first = lines.front();
+        write(first.sender,
+              util::inform_str("(", dropped, " notices were not displayed)"),
+              first.time);
+    }
+
+    for (const auto& l : lines) {
+        write(l.sender, l.message, l.time);
+    }
+
+    trim();
+}
+
+inline size_t DisplayQueue::scrollback_limit_from_env()
+{
+    static const size_t limit = [] {
+        const char* e = std::getenv("NP1SEC_TEST_CLIENT_SCROLLBACK");
+        if (!e) return default_scrollback_limit;
+        try {
+            return size_t(std::stoul(e));
+        }
+        catch (const std::exception&) {
+            return default_scrollback_limit;
+        }
+    }();
+
+    return limit;
+}
+
+inline void DisplayQueue::set_scrollback_limit(size_t lines)
+{
+    _scrollback_limit = lines;
+
+    if (auto h = imhtml()) {
+        if (_scrollback_limit) util::gtk::trim_lines(h, _scrollback_limit);
+    }
+}
+
+inline std::string DisplayQueue::scrollback_info() const
+{
+    auto h = imhtml();
+    if (!h) return "no conversation";
+
+    auto lines = gtk_text_buffer_get_line_count(h->text_buffer);
+    auto kib   = util::gtk::estimate_memory(h) / 1024;
+
+    return util::str(lines, " lines (limit ",
+                     (_scrollback_limit ? std::to_string(_scrollback_limit) : "none"),
+                     "), about ", kib, " KiB");
+}
+
+inline void DisplayQueue::trim()
+{
+    if (!_scrollback_limit) return;
+
+    auto h = imhtml();
+    if (!h) return;
+
+    auto slack = _scrollback_limit / 10;
+    auto lines = size_t(gtk_text_buffer_get_line_count(h->text_buffer));
+
+    if (lines > _scrollback_limit + slack) {
+        util::gtk::trim_lines(h, _scrollback_limit);
+    }
+}
+
+inline GtkIMHtml* DisplayQueue::imhtml() const
+{
+    if (!_conv) return nullptr;
+    auto gtkconv = PIDGIN_CONVERSATION(_conv);
+    if (!gtkconv) return nullptr;
+    return GTK_IMHTML(gtkconv->imhtml);
+}
+
+inline void DisplayQueue::write( const std::string& sender
+                               , const std::string& message
+                               , time_t time)
+{
+    /* conv->ui_ops->write_chat isn't set (is NULL) on Pidgin. */
+    assert(_conv && _conv->ui_ops && _conv->ui_ops->write_conv);
+    _conv->ui_ops->write_conv(_conv,
+                              sender.c_str(),
+                              sender.c_str(),
+                              message.c_str(),
+                              PURPLE_MESSAGE_RECV,
+                              time);
+}
+
+} // np1sec_plugin namespace
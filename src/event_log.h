@@ -0,0 +1,96 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <cassert>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace np1sec_plugin {
+
+/*
+ * Fixed size ring buffer of diagnostic (protocol event) messages. Once
+ * it is full the oldest entry is overwritten by each new one.
+ */
+class EventLog {
+public:
+    struct Entry {
+        time_t time;
+        std::string text;
+    };
+
+    static const size_t default_capacity = 1000;
+
+public:
+    EventLog(size_t capacity = default_capacity);
+
+    void push(std::string text);
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _entries.size(); }
+
+    /* Iterate from the oldest to the newest entry. */
+    template<class F> void for_each(F&& f) const;
+
+    /* Called for every pushed entry, e.g. to update an open view. */
+    std::function<void(const Entry&)> on_push;
+
+private:
+    std::vector<Entry> _entries;
+    size_t _begin = 0;
+    size_t _size  = 0;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline EventLog::EventLog(size_t capacity)
+    : _entries(capacity)
+{
+    assert(capacity > 0);
+}
+
+inline void EventLog::push(std::string text)
+{
+    auto& e = _entries[(_begin + _size) % capacity()];
+
+    e.time = time(NULL);
+    e.text = std::move(text);
+
+    if (_size == capacity()) {
+        _begin = (_begin + 1) % capacity();
+    }
+    else {
+        ++_size;
+    }
+
+    if (on_push) on_push(e);
+}
+
+template<class F>
+inline void EventLog::for_each(F&& f) const
+{
+    for (size_t i = 0; i < _size; ++i) {
+        f(_entries[(_begin + i) % capacity()]);
+    }
+}
+
+} // np1sec_plugin namespace
@@ -0,0 +1,158 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+#include "event_log.h"
+#include "util.h"
+
+namespace np1sec_plugin {
+
+/*
+ * A window showing the content of an EventLog and following new entries
+ * while it's open. Nothing is created until show() is first called.
+ */
+class EventLogDialog {
+public:
+    EventLogDialog(EventLog&, std::string title);
+    ~EventLogDialog();
+
+    EventLogDialog(const EventLogDialog&) = delete;
+    EventLogDialog& operator=(const EventLogDialog&) = delete;
+
+    void show(GtkWindow* parent_window);
+
+private:
+    void append(const EventLog::Entry&);
+    void close();
+
+    static void on_destroy(GtkWidget*, EventLogDialog*);
+
+private:
+    EventLog& _log;
+    std::string _title;
+
+    GtkWidget* _window = nullptr;
+    GtkTextBuffer* _buffer = nullptr;
+    GtkWidget* _text_view = nullptr;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline EventLogDialog::EventLogDialog(EventLog& log, std::string title)
+    : _log(log)
+    , _title(std::move(title))
+{
+}
+
+inline EventLogDialog::~EventLogDialog()
+{
+    close();
+}
+
+inline void EventLogDialog::show(GtkWindow* parent_window)
+{
+    if (_window) {
+        gtk_window_present(GTK_WINDOW(_window));
+        return;
+    }
+
+    _window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title(GTK_WINDOW(_window), _title.c_str());
+    gtk_window_set_default_size(GTK_WINDOW(_window), 600, 400);
+
+    if (parent_window) {
+        gtk_window_set_transient_for(GTK_WINDOW(_window), parent_window);
+    }
+
+    auto scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_AUTOMATIC,
+                                   GTK_POLICY_AUTOMATIC);
+
+    _text_view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(_text_view), FALSE);
+    gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(_text_view), FALSE);
+
+    _buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(_text_view));
+
+    gtk_container_add(GTK_CONTAINER(scrolled), _text_view);
+    gtk_container_add(GTK_CONTAINER(_window), scrolled);
+
+    g_signal_connect(G_OBJECT(_window), "destroy",
+                     G_CALLBACK(on_destroy), this);
+
+    _log.for_each([this] (const EventLog::Entry& e) { append(e); });
+    _log.on_push = [this] (const EventLog::Entry& e) { append(e); };
+
+    gtk_widget_show_all(_window);
+}
+
+inline void EventLogDialog::append(const EventLog::Entry& e)
+{
+    char time_str[16];
+    strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&e.time));
+
+    auto line = util::str(time_str, " ", e.text, "\n");
+
+    GtkTextIter end;
+    gtk_text_buffer_get_end_iter(_buffer, &end);
+    gtk_text_buffer_insert(_buffer, &end, line.c_str(), -1);
+
+    /* Keep the view as bounded as the log itself. */
+    if (size_t(gtk_text_buffer_get_line_count(_buffer)) > _log.capacity() + 1) {
+        GtkTextIter start, second;
+        gtk_text_buffer_get_start_iter(_buffer, &start);
+        gtk_text_buffer_get_iter_at_line(_buffer, &second, 1);
+        gtk_text_buffer_delete(_buffer, &start, &second);
+    }
+
+    gtk_text_buffer_get_end_iter(_buffer, &end);
+    auto mark = gtk_text_buffer_get_insert(_buffer);
+    gtk_text_buffer_place_cursor(_buffer, &end);
+    gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(_text_view), mark);
+}
+
+inline void EventLogDialog::close()
+{
+    if (!_window) return;
+
+    _log.on_push = nullptr;
+
+    auto window = _window;
+    _window = nullptr;
+    _buffer = nullptr;
+    _text_view = nullptr;
+
+    g_signal_handlers_disconnect_by_func(G_OBJECT(window),
+                                         (gpointer) on_destroy, this);
+    gtk_widget_destroy(window);
+}
+
+inline void EventLogDialog::on_destroy(GtkWidget*, EventLogDialog* self)
+{
+    /* The user closed the window, the widgets are going away. */
+    self->_log.on_push = nullptr;
+    self->_window = nullptr;
+    self->_buffer = nullptr;
+    self->_text_view = nullptr;
+}
+
+} // np1sec_plugin namespace
@@ -0,0 +1,226 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace np1sec_plugin {
+
+/*
+ * A serial executor: functions posted to it are executed one at a time,
+ * in the order they were posted, on a dedicated thread. Delayed functions
+ * (used to implement np1sec timers) run on the same thread once their
+ * deadline has passed.
+ */
+class Executor {
+public:
+    using Clock   = std::chrono::steady_clock;
+    using Task    = std::function<void()>;
+    using TimerId = uint64_t;
+
+public:
+    Executor();
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    void post(Task);
+
+    /* Functions with the same deadline run in the order they were
+     * posted. */
+    TimerId post_after(uint32_t interval_ms, Task);
+    void cancel(TimerId);
+
+    /*
+     * Execute f on the worker thread and block until it is done.
+     * Anything posted before f is executed before it.
+     */
+    template<class F> auto call(F&& f) -> decltype(f());
+
+    bool is_worker_thread() const;
+
+    /*
+     * Join the worker thread. Tasks that haven't been executed yet
+     * are discarded.
+     */
+    void stop();
+
+private:
+    void run();
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stopped = false;
+
+    std::deque<Task> _tasks;
+
+    TimerId _next_timer_id = 1;
+    std::map<TimerId, std::pair<Clock::time_point, Task>> _timers;
+    std::set<std::pair<Clock::time_point, TimerId>> _deadlines;
+
+    std::thread _thread;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline Executor::Executor()
+    : _thread([this] { run(); })
+{
+}
+
+inline Executor::~Executor()
+{
+    stop();
+}
+
+inline void Executor::post(Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.push_back(std::move(task));
+    }
+    _cv.notify_one();
+}
+
+inline
+Executor::TimerId Executor::post_after(uint32_t interval_ms, Task task)
+{
+    auto deadline = Clock::now() + std::chrono::milliseconds(interval_ms);
+
+    TimerId id;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        id = _next_timer_id++;
+        _timers.emplace(id, std::make_pair(deadline, std::move(task)));
+        _deadlines.emplace(deadline, id);
+    }
+    _cv.notify_one();
+
+    return id;
+}
+
+inline void Executor::cancel(TimerId id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto i = _timers.find(id);
+    if (i == _timers.end()) return;
+
+    _deadlines.erase(std::make_pair(i->second.first, id));
+    _timers.erase(i);
+}
+
+template<class F>
+inline auto Executor::call(F&& f) -> decltype(f())
+{
+    using R = decltype(f());
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        /* Running f directly avoids a deadlock when called from
+         * the worker itself or once the worker is gone. */
+        if (_stopped || is_worker_thread()) {
+            return f();
+        }
+    }
+
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+    auto result = task->get_future();
+
+    post([task] { (*task)(); });
+
+    return result.get();
+}
+
+inline bool Executor::is_worker_thread() const
+{
+    return std::this_thread::get_id() == _thread.get_id();
+}
+
+inline void Executor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopped) return;
+        _stopped = true;
+    }
+
+    _cv.notify_one();
+
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+
+    _tasks.clear();
+    _timers.clear();
+    _deadlines.clear();
+}
+
+inline void Executor::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_stopped) {
+        if (!_tasks.empty()) {
+            auto task = std::move(_tasks.front());
+            _tasks.pop_front();
+
+            lock.unlock();
+            task();
+            lock.lock();
+            continue;
+        }
+
+        if (_deadlines.empty()) {
+            _cv.wait(lock);
+            continue;
+        }
+
+        auto next = *_deadlines.begin();
+
+        if (next.first > Clock::now()) {
+            _cv.wait_until(lock, next.first);
+            continue;
+        }
+
+        _deadlines.erase(_deadlines.begin());
+
+        auto timer_i = _timers.find(next.second);
+        auto task = std::move(timer_i->second.second);
+        _timers.erase(timer_i);
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+} // np1sec_plugin namespace
@@ -18,7 +18,6 @@
 
 #pragma once
 
-#include <algorithm>
 #include <iostream>
 #include "util.h"
 
@@ -26,22 +25,10 @@ namespace np1sec_plugin {
 
 template<class... Args> inline void log(Args&&... args)
 {
-    static boost::optional<bool> print_output;
+    static const bool print_output
+        = util::env_flag("NP1SEC_TEST_CLIENT_PRINT_LOG");
 
-    if (!print_output) {
-        const char* e = std::getenv("NP1SEC_TEST_CLIENT_PRINT_LOG");
-
-        if (e) {
-            std::string env(e);
-            std::transform(env.begin(), env.end(), env.begin(), ::tolower);
-            print_output = (env == "1" || env == "true" || env == "yes");
-        }
-        else {
-            print_output = false;
-        }
-    }
-
-    if (*print_output) {
+    if (print_output) {
         std::cout << "np1sec_plugin: "
                   << util::str(std::forward<Args>(args)...)
                   << std::endl;
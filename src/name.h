@@ -0,0 +1,185 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+
+namespace np1sec_plugin {
+
+class NameTable;
+
+/*
+ * A username interned in a room's NameTable. All copies share one
+ * string, comparing, ordering and hashing only look at its address
+ * (so the order of Names is not alphabetical).
+ *
+ * Names are reference counted without locking, they must only be used
+ * on the GTK thread.
+ */
+class Name {
+public:
+    Name() {}
+    Name(const Name&);
+    Name(Name&&);
+    Name& operator=(Name);
+    ~Name();
+
+    /* The empty string for a default constructed Name. */
+    const std::string& str() const;
+
+    explicit operator bool() const { return _entry != nullptr; }
+
+    bool operator==(const Name& n) const { return _entry == n._entry; }
+    bool operator!=(const Name& n) const { return _entry != n._entry; }
+    bool operator<(const Name& n)  const { return std::less<Entry*>()(_entry, n._entry); }
+
+    struct Hash {
+        size_t operator()(const Name& n) const {
+            return std::hash<const void*>()(n._entry);
+        }
+    };
+
+private:
+    friend class NameTable;
+
+    struct Entry {
+        std::string str;
+        size_t refs;
+        NameTable* table;
+    };
+
+    explicit Name(Entry*);
+
+    Entry* _entry = nullptr;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const Name& n)
+{
+    return os << n.str();
+}
+
+/*
+ * Hands out Names, an entry is dropped once no Name references it.
+ */
+class NameTable {
+public:
+    NameTable() {}
+    ~NameTable();
+
+    NameTable(const NameTable&) = delete;
+    NameTable& operator=(const NameTable&) = delete;
+
+    Name intern(const std::string&);
+
+    /* The Name if the string is interned, an empty Name otherwise. */
+    Name find(boost::string_ref) const;
+
+    size_t size() const { return _entries.size(); }
+
+private:
+    friend class Name;
+
+    struct RefHash {
+        size_t operator()(boost::string_ref s) const {
+            return boost::hash_range(s.begin(), s.end());
+        }
+    };
+
+    /* The keys point into the entries' strings. */
+    std::unordered_map<boost::string_ref, Name::Entry*, RefHash> _entries;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline Name::Name(Entry* e)
+    : _entry(e)
+{
+    ++_entry->refs;
+}
+
+inline Name::Name(const Name& n)
+    : _entry(n._entry)
+{
+    if (_entry) ++_entry->refs;
+}
+
+inline Name::Name(Name&& n)
+    : _entry(n._entry)
+{
+    n._entry = nullptr;
+}
+
+inline Name& Name::operator=(Name n)
+{
+    std::swap(_entry, n._entry);
+    return *this;
+}
+
+inline Name::~Name()
+{
+    if (!_entry || --_entry->refs) return;
+
+    if (_entry->table) {
+        _entry->table->_entries.erase(_entry->str);
+    }
+
+    delete _entry;
+}
+
+inline const std::string& Name::str() const
+{
+    static const std::string empty;
+    return _entry ? _entry->str : empty;
+}
+
+//------------------------------------------------------------------------------
+inline NameTable::~NameTable()
+{
+    /* Names outliving the table keep their entries alive. */
+    for (auto& e : _entries) {
+        e.second->table = nullptr;
+    }
+}
+
+inline Name NameTable::intern(const std::string& s)
+{
+    auto i = _entries.find(s);
+
+    if (i != _entries.end()) return Name(i->second);
+
+    auto e = new Name::Entry{s, 0, this};
+    _entries.emplace(e->str, e);
+
+    return Name(e);
+}
+
+inline Name NameTable::find(boost::string_ref s) const
+{
+    auto i = _entries.find(s);
+    if (i == _entries.end()) return Name();
+    return Name(i->second);
+}
+
+} // np1sec_plugin namespace
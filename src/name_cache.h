@@ -0,0 +1,118 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "util.h"
+
+namespace np1sec_plugin {
+
+/*
+ * Remembers what the account's protocol normalizes sender names to, so
+ * that the same few nicks don't go through the prpl's normalize
+ * function (JID parsing and case folding on XMPP) for every message.
+ *
+ * The cache is bounded: names are kept in two generations of at most
+ * capacity entries each. When the current generation is full it becomes
+ * the old one and the previous old one is dropped, names found in the
+ * old generation are moved back into the current one.
+ *
+ * Lookups go by string_ref, so a hit allocates nothing.
+ */
+class NameCache {
+public:
+    static const size_t default_capacity = 256;
+
+public:
+    NameCache(size_t capacity = default_capacity) : _capacity(capacity) {}
+
+    /* The result stays valid until the next call. */
+    const std::string& normalize(PurpleAccount*, const char* name);
+
+    /* Must be called whenever normalization may have changed (e.g. the
+     * account reconnected). */
+    void clear();
+
+private:
+    struct Entry {
+        std::string name;
+        std::string normalized;
+    };
+
+    struct RefHash {
+        size_t operator()(boost::string_ref s) const {
+            return boost::hash_range(s.begin(), s.end());
+        }
+    };
+
+    /* The keys point into the entries' names. */
+    using Map = std::unordered_map< boost::string_ref
+                                  , std::unique_ptr<Entry>
+                                  , RefHash>;
+
+    size_t _capacity;
+    Map _current;
+    Map _old;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline
+const std::string& NameCache::normalize(PurpleAccount* account, const char* name)
+{
+    boost::string_ref key(name ? name : "");
+
+    auto i = _current.find(key);
+    if (i != _current.end()) return i->second->normalized;
+
+    std::unique_ptr<Entry> entry;
+
+    auto j = _old.find(key);
+
+    if (j != _old.end()) {
+        entry = std::move(j->second);
+        _old.erase(j);
+    }
+    else {
+        auto n = util::normalize_name(account, name);
+        entry.reset(new Entry{key.to_string(), n ? n : key.to_string()});
+    }
+
+    if (_current.size() >= _capacity) {
+        _old = std::move(_current);
+        _current.clear();
+    }
+
+    auto& e = *entry;
+    _current.emplace(e.name, std::move(entry));
+    return e.normalized;
+}
+
+inline void NameCache::clear()
+{
+    _current.clear();
+    _old.clear();
+}
+
+} // np1sec_plugin namespace
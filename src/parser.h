@@ -18,39 +18,53 @@
 
 #pragma once
 
-#include <sstream>
+#include <stdexcept>
+#include <boost/utility/string_ref.hpp>
 
 namespace np1sec_plugin {
 
+/*
+ * Splits a command line into space separated words. The words are
+ * references into the original text, nothing is copied.
+ */
 struct Parser {
     using parse_error = std::runtime_error;
 
+    boost::string_ref text;
     size_t curpos = 0;
-    std::string text;
 
-    Parser(std::string text)
-        : text(std::move(text))
+    Parser(boost::string_ref text)
+        : text(text)
     {
+        skip_spaces();
     }
 
-    std::string read_word() {
-        auto thrw = [](const char* err) {
-            throw std::runtime_error(std::string("read_command: ") + err);
-        };
-        if (curpos == text.size()) thrw("attempt to read past the end");
-        if (text[curpos] == ' ') thrw("command starts with space");
-
-        auto p = text.find(' ', curpos);
+    bool at_end() const {
+        return curpos == text.size();
+    }
 
-        if (p != std::string::npos) {
-            auto retval = text.substr(curpos, (p - curpos));
-            curpos = p + 1;
-            return retval;
+    boost::string_ref read_word() {
+        if (at_end()) {
+            throw parse_error("read_word: attempt to read past the end");
         }
 
-        auto retval = text.substr(curpos, text.size() - curpos);
-        curpos = text.size();
-        return retval;
+        auto begin = curpos;
+
+        while (curpos != text.size() && text[curpos] != ' ') ++curpos;
+
+        auto word = text.substr(begin, curpos - begin);
+        skip_spaces();
+        return word;
+    }
+
+    /* The not yet read part of the text. */
+    boost::string_ref rest() const {
+        return text.substr(curpos);
+    }
+
+private:
+    void skip_spaces() {
+        while (curpos != text.size() && text[curpos] == ' ') ++curpos;
     }
 };
 
@@ -24,6 +24,9 @@
 #define PURPLE_PLUGINS
 
 #include <string.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
 #include <boost/algorithm/string/predicate.hpp>
 
 /* Purple headers */
@@ -39,8 +42,10 @@
 #include <pidgin/gtkconv.h>
 
 /* Plugin headers */
+#include "check.h"
 #include "room.h"
 #include "global_signals.h"
+#include "conversation_queue.h"
 
 using Room = np1sec_plugin::Room;
 
@@ -82,6 +87,13 @@ static bool is_in_chat(PurpleConversation* conv) {
 
 extern "C" {
 
+/*
+ * While the plugin loads or unloads chats one by one, the chat signals
+ * are connected but only some chats have a Room, the others are ignored.
+ */
+static bool loading();
+static bool unloading();
+
 #define _(x) const_cast<char*>(x)
 
 //------------------------------------------------------------------------------
@@ -102,8 +114,8 @@ static void chat_joined_cb(PurpleConversation* conv, void*)
 static void chat_left_cb(PurpleConversation* conv, void*)
 {
     auto room = get_room(conv);
-    assert(room);
-    room->chat_left();
+    NP1SEC_CHECK(room || loading() || unloading());
+    if (room) room->chat_left();
 }
 
 static gboolean receiving_chat_msg_cb(PurpleAccount *account,
@@ -117,19 +129,21 @@ static gboolean receiving_chat_msg_cb(PurpleAccount *account,
     if (!is_chat(conv)) return FALSE;
 
     auto room = get_room(conv);
-    assert(room);
+    NP1SEC_CHECK(room || loading() || unloading());
     if (!room) return FALSE;
 
-    static const std::string np1sec_header = ":o3np1sec0:";
+    static const char np1sec_header[] = ":o3np1sec0:";
 
-    if (std::string(*message).substr(0, np1sec_header.size()) != np1sec_header) {
+    if (strncmp(*message, np1sec_header, sizeof(np1sec_header) - 1) != 0) {
         return FALSE;
     }
 
-    // Ignore historic messages.
-    if (*flags & PURPLE_MESSAGE_DELAYED) return TRUE;
+    if (*flags & PURPLE_MESSAGE_DELAYED) {
+        room->on_received_history(room->normalize_name(*sender), *message);
+        return TRUE;
+    }
 
-    room->on_received_data(util::normalize_name(account, *sender), *message);
+    room->on_received_data(room->normalize_name(*sender), *message);
 
     // Returning TRUE causes this message not to be displayed.
     // Displaying is done explicitly from np1sec.
@@ -158,8 +172,7 @@ void chat_buddy_joined_cb(PurpleConversation *conv, const char *name,
     auto room = get_room(conv);
     if (!room) return;
 
-    // Note the comment in the chat_joined_cb function.
-    room->chat_joined();
+    room->buddy_joined(name);
 }
 
 static
@@ -168,8 +181,8 @@ void chat_buddy_left_cb(PurpleConversation* conv, const char* name, const char*,
     if (!is_chat(conv)) return;
 
     auto room = get_room(conv);
-    assert(room);
-    if (room) room->user_left(name);
+    NP1SEC_CHECK(room || loading() || unloading());
+    if (room) room->buddy_left(name);
 }
 
 //------------------------------------------------------------------------------
@@ -177,8 +190,8 @@ static void  apply_np1sec(PurpleConversation* conv)
 {
     using namespace np1sec_plugin;
 
-    assert(is_chat(conv));
-    assert(!get_room(conv));
+    NP1SEC_CHECK(is_chat(conv));
+    NP1SEC_CHECK(!get_room(conv));
 
     auto room = std::make_shared<Room>(conv);
     auto room_view = new RoomView(conv, room);
@@ -197,7 +210,7 @@ static void unapply_np1sec(PurpleConversation* conv)
 {
     using np1sec_plugin::log;
 
-    assert(is_chat(conv));
+    NP1SEC_CHECK(is_chat(conv));
 
     auto channel_view = np1sec_plugin::get_channel_view(conv);
     auto room_view    = np1sec_plugin::get_room_view(conv);
@@ -208,7 +221,7 @@ static void unapply_np1sec(PurpleConversation* conv)
      * A pidgin conversation can't at the same time represent a room and
      * a channel.
      */
-    assert(!(channel_view && room_view));
+    NP1SEC_CHECK(!(channel_view && room_view));
 
     /*
      * It is important here to first set the channel view to null to
@@ -228,12 +241,78 @@ static void unapply_np1sec(PurpleConversation* conv)
     log("unapply_np1sec end");
 }
 
+//------------------------------------------------------------------------------
+/*
+ * How prominently a conversation is shown: 2 for the conversation the user
+ * is typing in, 1 for the active tab of another window, 0 otherwise.
+ */
+static int visibility(PurpleConversation* conv)
+{
+    auto gtkconv = PIDGIN_CONVERSATION(conv);
+    if (!gtkconv || !gtkconv->win) return 0;
+
+    if (!pidgin_conv_window_is_active_conversation(conv)) return 0;
+
+    return pidgin_conv_window_has_focus(gtkconv->win) ? 2 : 1;
+}
+
+/*
+ * Chats to load or unload, the most visible first.
+ */
+static std::vector<PurpleConversation*>
+chats_by_visibility(bool (*pred)(PurpleConversation*))
+{
+    std::vector<std::pair<int, PurpleConversation*>> chats;
+
+    for (auto l = purple_get_conversations(); l; l = l->next) {
+        auto conv = reinterpret_cast<PurpleConversation*>(l->data);
+        if (is_chat(conv) && pred(conv)) {
+            chats.emplace_back(visibility(conv), conv);
+        }
+    }
+
+    std::stable_sort(chats.begin(), chats.end(),
+                     [](const std::pair<int, PurpleConversation*>& a,
+                        const std::pair<int, PurpleConversation*>& b) {
+                         return a.first > b.first;
+                     });
+
+    std::vector<PurpleConversation*> result;
+    for (const auto& c : chats) result.push_back(c.second);
+    return result;
+}
+
 //------------------------------------------------------------------------------
 static ::np1sec_plugin::GlobalSignals* g_signals = nullptr;
 
+/*
+ * Chats that existed before the plugin was loaded are handled
+ * incrementally, as are all chats when it's unloaded.
+ */
+static std::unique_ptr<::np1sec_plugin::ConversationQueue> g_load_queue;
+static std::unique_ptr<::np1sec_plugin::ConversationQueue> g_unload_queue;
+
+/* Set once Pidgin is quitting, nothing runs incrementally anymore. */
+static bool g_quitting = false;
+
+static void quitting_cb(void*)
+{
+    g_quitting = true;
+}
+
+static bool loading()
+{
+    return g_load_queue != nullptr;
+}
+
+static bool unloading()
+{
+    return g_unload_queue != nullptr;
+}
+
 static void setup_purple_callbacks(PurplePlugin* plugin)
 {
-    assert(!g_signals);
+    NP1SEC_CHECK(!g_signals);
     g_signals = new ::np1sec_plugin::GlobalSignals();
 
     g_signals->on_conversation_created = [](PurpleConversation* conv) {
@@ -242,76 +321,121 @@ static void setup_purple_callbacks(PurplePlugin* plugin)
     };
 
     g_signals->on_conversation_deleted = [](PurpleConversation* conv) {
+        /* Its address may be reused by a later conversation. */
+        if (g_load_queue) g_load_queue->remove(conv);
+        if (g_unload_queue) g_unload_queue->remove(conv);
+
         if (!is_chat(conv)) return;
         unapply_np1sec(conv);
     };
 
+    purple_signal_connect(purple_get_core(), "quitting", plugin, PURPLE_CALLBACK(quitting_cb), NULL);
+
+    /* Purple drops the plugin's own signal handlers when it unloads, the
+     * chat signals are needed until the last chat is unloaded. */
+    void* handle = g_signals;
     void* conv_handle = purple_conversations_get_handle();
 
-    purple_signal_connect(conv_handle, "chat-buddy-joined", plugin, PURPLE_CALLBACK(chat_buddy_joined_cb), NULL);
-    purple_signal_connect(conv_handle, "chat-buddy-left", plugin, PURPLE_CALLBACK(chat_buddy_left_cb), NULL);
-    purple_signal_connect(conv_handle, "chat-joined", plugin, PURPLE_CALLBACK(chat_joined_cb), NULL);
-    purple_signal_connect(conv_handle, "chat-left", plugin, PURPLE_CALLBACK(chat_left_cb), NULL);
-    purple_signal_connect(conv_handle, "receiving-chat-msg", plugin, PURPLE_CALLBACK(receiving_chat_msg_cb), NULL);
-    purple_signal_connect(conv_handle, "sending-chat-msg", plugin, PURPLE_CALLBACK(sending_chat_msg_cb), NULL);
+    purple_signal_connect(conv_handle, "chat-buddy-joined", handle, PURPLE_CALLBACK(chat_buddy_joined_cb), NULL);
+    purple_signal_connect(conv_handle, "chat-buddy-left", handle, PURPLE_CALLBACK(chat_buddy_left_cb), NULL);
+    purple_signal_connect(conv_handle, "chat-joined", handle, PURPLE_CALLBACK(chat_joined_cb), NULL);
+    purple_signal_connect(conv_handle, "chat-left", handle, PURPLE_CALLBACK(chat_left_cb), NULL);
+    purple_signal_connect(conv_handle, "receiving-chat-msg", handle, PURPLE_CALLBACK(receiving_chat_msg_cb), NULL);
+    purple_signal_connect(conv_handle, "sending-chat-msg", handle, PURPLE_CALLBACK(sending_chat_msg_cb), NULL);
 }
 
+/*
+ * GlobalSignals and the chat signals stay until all chats are unloaded,
+ * see disconnect_chat_callbacks. Chats the user closes in the meantime
+ * must still be unloaded when they are deleted.
+ */
 static void disconnect_purple_callbacks(PurplePlugin* plugin)
 {
-    delete g_signals;
-    g_signals = nullptr;
+    g_signals->on_conversation_created = nullptr;
 
+    purple_signal_disconnect(purple_get_core(), "quitting", plugin, PURPLE_CALLBACK(quitting_cb));
+}
+
+static void disconnect_chat_callbacks()
+{
+    void* handle = g_signals;
     void* conv_handle = purple_conversations_get_handle();
 
-    purple_signal_disconnect(conv_handle, "chat-buddy-joined", plugin, PURPLE_CALLBACK(chat_buddy_joined_cb));
-    purple_signal_disconnect(conv_handle, "chat-buddy-left", plugin, PURPLE_CALLBACK(chat_buddy_left_cb));
-    purple_signal_disconnect(conv_handle, "chat-joined", plugin, PURPLE_CALLBACK(chat_joined_cb));
-    purple_signal_disconnect(conv_handle, "chat-left", plugin, PURPLE_CALLBACK(chat_left_cb));
-    purple_signal_disconnect(conv_handle, "receiving-chat-msg", plugin, PURPLE_CALLBACK(receiving_chat_msg_cb));
-    purple_signal_disconnect(conv_handle, "sending-chat-msg", plugin, PURPLE_CALLBACK(sending_chat_msg_cb));
+    purple_signal_disconnect(conv_handle, "chat-buddy-joined", handle, PURPLE_CALLBACK(chat_buddy_joined_cb));
+    purple_signal_disconnect(conv_handle, "chat-buddy-left", handle, PURPLE_CALLBACK(chat_buddy_left_cb));
+    purple_signal_disconnect(conv_handle, "chat-joined", handle, PURPLE_CALLBACK(chat_joined_cb));
+    purple_signal_disconnect(conv_handle, "chat-left", handle, PURPLE_CALLBACK(chat_left_cb));
+    purple_signal_disconnect(conv_handle, "receiving-chat-msg", handle, PURPLE_CALLBACK(receiving_chat_msg_cb));
+    purple_signal_disconnect(conv_handle, "sending-chat-msg", handle, PURPLE_CALLBACK(sending_chat_msg_cb));
+
+    delete g_signals;
+    g_signals = nullptr;
 }
 
 gboolean np1sec_plugin_load(PurplePlugin* plugin)
 {
+    using np1sec_plugin::ConversationQueue;
+
+    /* Being enabled again before the previous unload finished. */
+    if (g_unload_queue) g_unload_queue->finish();
+
     setup_purple_callbacks(plugin);
 
     //---------------------------------------------------
     // Apply the plugin to chats which were created before
     // this plugin was loaded.
-    GList *convs = purple_get_conversations();
-
-    while (convs) {
+    g_load_queue.reset(new ConversationQueue("load", [](PurpleConversation* conv) {
+        if (get_room(conv)) return;
+        /* We'll make use of this variable, so make sure pidgin
+         * isn't using it for some other purpose. */
+        NP1SEC_CHECK(!conv->account->ui_data);
+        apply_np1sec(conv);
+    }));
 
-        PurpleConversation *conv = (PurpleConversation *)convs->data;
+    /* Until then chats without a Room are expected, see loading(). */
+    g_load_queue->on_done = [] { g_load_queue.reset(); };
 
-        if (is_chat(conv) && !get_room(conv)) {
-            /* We'll make use of this variable, so make sure pidgin
-             * isn't using it for some other purpose. */
-            assert(!conv->account->ui_data);
-            apply_np1sec(conv);
-        }
-
-        convs = convs->next;
+    for (auto conv : chats_by_visibility([](PurpleConversation* c) { return !get_room(c); })) {
+        g_load_queue->push(conv);
     }
 
+    g_load_queue->start();
+
     return true;
 }
 
 gboolean np1sec_plugin_unload(PurplePlugin* plugin)
 {
-    disconnect_purple_callbacks(plugin);
+    using np1sec_plugin::ConversationQueue;
 
-    GList *convs = purple_get_conversations();
+    /* Chats not loaded yet don't need unloading. */
+    if (g_load_queue) {
+        g_load_queue->cancel();
+        g_load_queue.reset();
+    }
 
-    while (convs) {
+    disconnect_purple_callbacks(plugin);
 
-        PurpleConversation *conv = (PurpleConversation *)convs->data;
+    g_unload_queue.reset(new ConversationQueue("unload", unapply_np1sec));
 
-        if (is_chat(conv)) {
-            unapply_np1sec(conv);
-        }
+    g_unload_queue->on_done = [] {
+        disconnect_chat_callbacks();
+        /* Rooms still loaded until now could have built menus. */
+        np1sec_plugin::release_popup_menus();
+        /* Destroying the queue from its own callback is fine, it
+         * doesn't touch itself after on_done. */
+        g_unload_queue.reset();
+    };
 
-        convs = convs->next;
+    for (auto conv : chats_by_visibility([](PurpleConversation*) { return true; })) {
+        g_unload_queue->push(conv);
+    }
+
+    if (g_quitting) {
+        g_unload_queue->finish();
+    }
+    else {
+        g_unload_queue->start();
     }
 
     return true;
@@ -18,46 +18,155 @@
 
 #pragma once
 
+#include <cstdint>
+#include <map>
 #include "defer.h"
 #include "util.h"
 
 namespace np1sec_plugin {
 
-using PopupActions = std::map<std::string, std::function<void()>>;
+/*
+ * What can be done to a user from a list's popup menu or by double
+ * clicking it.
+ */
+enum class PopupAction : uint8_t {
+    invite,
+    join,
+};
+
+inline const char* popup_action_label(PopupAction a)
+{
+    switch (a) {
+        case PopupAction::invite: return "Invite";
+        case PopupAction::join:   return "Join";
+    }
+    return "";
+}
+
+/*
+ * A set of actions, shown in the order of the enum. Fits in a byte, so
+ * changing it never allocates.
+ */
+class PopupActions {
+public:
+    bool empty() const { return _bits == 0; }
+    void clear() { _bits = 0; }
+
+    void insert(PopupAction a) { _bits |= bit(a); }
+    bool contains(PopupAction a) const { return _bits & bit(a); }
+
+    /* Identifies the set, e.g. to look up its menu. */
+    uint8_t bits() const { return _bits; }
+
+    template<class F> void for_each(F&& f) const {
+        for (unsigned i = 0; i < 8; ++i) {
+            if (_bits & (1u << i)) f(PopupAction(i));
+        }
+    }
+
+private:
+    static uint8_t bit(PopupAction a) { return uint8_t(1u << unsigned(a)); }
+
+    uint8_t _bits = 0;
+};
+
+/*
+ * Receives the action picked from a popup shown for it. A target that
+ * goes away while its popup is open is forgotten, picking an item then
+ * does nothing.
+ */
+class PopupTarget {
+public:
+    virtual void on_popup_action(PopupAction) = 0;
+
+protected:
+    ~PopupTarget();
+};
 
 namespace popup_detail {
-    static
-    void on_popup_item_pressed(GtkWidget*, gpointer* data)
+    /* The target of the popup currently shown, if any. */
+    inline PopupTarget*& current_target()
     {
-        auto& func = *reinterpret_cast<PopupActions::mapped_type*>(data);
-        func();
+        static PopupTarget* target = nullptr;
+        return target;
     }
-} // popup_detail namespace
 
+    inline
+    void on_popup_item_pressed(GtkWidget*, gpointer data)
+    {
+        auto action = PopupAction(GPOINTER_TO_INT(data));
 
-void show_popup( GdkEventButton* event, const PopupActions& actions)
-{
-    using A = PopupActions::mapped_type;
+        if (auto target = current_target()) {
+            target->on_popup_action(action);
+        }
+    }
 
-    if (actions.empty()) return;
+    /* Menus built so far, by action set. There are only a handful of
+     * sets, so these are kept until release_popup_menus. */
+    inline std::map<uint8_t, GtkWidget*>& menus()
+    {
+        static std::map<uint8_t, GtkWidget*> menus;
+        return menus;
+    }
 
-    auto menu = gtk_menu_new();
+    inline GtkWidget* build_menu(PopupActions actions)
+    {
+        auto menu = gtk_menu_new();
+        g_object_ref_sink(menu);
 
-    for (const auto& action : actions) {
-        auto menuitem = gtk_menu_item_new_with_label(action.first.c_str());
+        actions.for_each([menu] (PopupAction a) {
+            auto menuitem = gtk_menu_item_new_with_label(popup_action_label(a));
 
-        g_signal_connect(menuitem, "activate",
-                         (GCallback) popup_detail::on_popup_item_pressed,
-                         const_cast<A*>(&action.second));
+            g_signal_connect(menuitem, "activate",
+                             (GCallback) on_popup_item_pressed,
+                             GINT_TO_POINTER(int(a)));
 
-        gtk_menu_shell_append(GTK_MENU_SHELL(menu), menuitem);
+            gtk_menu_shell_append(GTK_MENU_SHELL(menu), menuitem);
+        });
+
+        gtk_widget_show_all(menu);
+        return menu;
     }
+} // popup_detail namespace
+
+inline PopupTarget::~PopupTarget()
+{
+    auto& target = popup_detail::current_target();
+    if (target == this) target = nullptr;
+}
+
+/*
+ * Pop up the menu of the action set, built on the first use and reused
+ * afterwards. Only the target changes between clicks.
+ */
+inline
+void show_popup(GdkEventButton* event, PopupActions actions, PopupTarget& target)
+{
+    if (actions.empty()) return;
+
+    popup_detail::current_target() = &target;
 
-    gtk_widget_show_all(menu);
+    auto& menu = popup_detail::menus()[actions.bits()];
+
+    if (!menu) {
+        menu = popup_detail::build_menu(actions);
+    }
 
     gtk_menu_popup(GTK_MENU(menu), NULL, NULL, NULL, NULL,
                    event ? event->button : 0,
                    gdk_event_get_time((GdkEvent*)event));
 }
 
+/* Destroy the cached menus, e.g. when the plugin is unloaded. */
+inline void release_popup_menus()
+{
+    for (auto& m : popup_detail::menus()) {
+        gtk_widget_destroy(m.second);
+        g_object_unref(m.second);
+    }
+
+    popup_detail::menus().clear();
+    popup_detail::current_target() = nullptr;
+}
+
 } // np1sec_plugin
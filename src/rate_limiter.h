@@ -0,0 +1,190 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util.h"
+
+namespace np1sec_plugin {
+
+/*
+ * Token bucket per sender. Each message takes one token, a sender's
+ * bucket holds at most burst tokens and refills at rate tokens per
+ * second, messages arriving at an empty bucket are dropped. There is a
+ * normal and a raised budget, chosen per message, so a sender can move
+ * to the raised one (e.g. by joining a channel) without losing its state.
+ *
+ * At most max_senders buckets are kept. Beyond that, buckets which have
+ * refilled completely carry no information and are forgotten.
+ */
+class RateLimiter {
+    using Clock = std::chrono::steady_clock;
+
+public:
+    static const size_t max_senders = 1024;
+
+    struct Budget {
+        double rate;   // Tokens per second
+        double burst;  // Bucket size
+    };
+
+    enum class Verdict {
+        pass,
+        drop,
+        first_drop,  // Dropped after the sender's previous message passed
+    };
+
+    struct Stats {
+        size_t passed  = 0;
+        size_t dropped = 0;
+    };
+
+public:
+    RateLimiter(Budget normal, Budget raised);
+    explicit RateLimiter(Budget b) : RateLimiter(b, b) {}
+
+    Verdict take(const std::string& sender, bool raised);
+
+    const Stats& stats() const { return _stats; }
+
+    /* Totals and the senders with the most dropped messages. */
+    std::string stats_info() const;
+
+    /* Forget all senders and reset the stats. */
+    void clear();
+
+private:
+    struct Bucket {
+        double tokens;
+        Clock::time_point last;
+        bool dropping;
+        size_t dropped;
+    };
+
+    void prune(Clock::time_point now);
+
+private:
+    Budget _normal;
+    Budget _raised;
+    /* How long an empty bucket takes to fill up with either budget. */
+    std::chrono::duration<double> _max_refill;
+    std::unordered_map<std::string, Bucket> _buckets;
+    Stats _stats;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline RateLimiter::RateLimiter(Budget normal, Budget raised)
+    : _normal(normal)
+    , _raised(raised)
+    , _max_refill(std::max(normal.burst / normal.rate, raised.burst / raised.rate))
+{
+}
+
+inline void RateLimiter::clear()
+{
+    _buckets.clear();
+    _stats = Stats();
+}
+
+inline
+RateLimiter::Verdict RateLimiter::take(const std::string& sender, bool raised)
+{
+    auto now = Clock::now();
+    const auto& budget = raised ? _raised : _normal;
+
+    auto i = _buckets.find(sender);
+
+    if (i == _buckets.end()) {
+        if (_buckets.size() >= max_senders) prune(now);
+        i = _buckets.emplace(sender, Bucket{budget.burst, now, false, 0}).first;
+    }
+
+    auto& b = i->second;
+
+    std::chrono::duration<double> elapsed = now - b.last;
+    b.last   = now;
+    b.tokens = std::min(budget.burst, b.tokens + elapsed.count() * budget.rate);
+
+    if (b.tokens >= 1) {
+        b.tokens -= 1;
+        b.dropping = false;
+        ++_stats.passed;
+        return Verdict::pass;
+    }
+
+    ++b.dropped;
+    ++_stats.dropped;
+
+    if (b.dropping) return Verdict::drop;
+
+    b.dropping = true;
+    return Verdict::first_drop;
+}
+
+inline void RateLimiter::prune(Clock::time_point now)
+{
+    for (auto i = _buckets.begin(); i != _buckets.end();) {
+        if (now - i->second.last >= _max_refill) {
+            i = _buckets.erase(i);
+        }
+        else {
+            ++i;
+        }
+    }
+
+    /* Everyone is busy, start over rather than grow without bound. */
+    if (_buckets.size() >= max_senders) _buckets.clear();
+}
+
+inline std::string RateLimiter::stats_info() const
+{
+    static const size_t max_listed = 5;
+
+    std::vector<std::pair<size_t, const std::string*>> droppers;
+
+    for (const auto& b : _buckets) {
+        if (b.second.dropped) droppers.emplace_back(b.second.dropped, &b.first);
+    }
+
+    auto n = std::min(max_listed, droppers.size());
+
+    std::partial_sort(droppers.begin(), droppers.begin() + n, droppers.end(),
+                      [] (const std::pair<size_t, const std::string*>& a,
+                          const std::pair<size_t, const std::string*>& b) {
+                          return a.first > b.first;
+                      });
+
+    auto info = util::str(_stats.passed, " passed, ", _stats.dropped, " dropped");
+
+    for (size_t i = 0; i != n; ++i) {
+        info += util::str(i ? ", " : " (", *droppers[i].second, ": ", droppers[i].first);
+    }
+
+    if (n) info += ")";
+
+    return info;
+}
+
+} // np1sec_plugin namespace
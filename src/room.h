@@ -21,14 +21,25 @@
 #include <memory>
 #include <iostream>
 #include <queue>
+#include <boost/container/flat_map.hpp>
 
 /* Np1sec headers */
 #include "src/interface.h"
 #include "src/room.h"
 
 /* Plugin headers */
+#include "capture.h"
+#include "check.h"
+#include "event_log.h"
+#include "event_log_dialog.h"
+#include "executor.h"
+#include "name.h"
+#include "name_cache.h"
+#include "rate_limiter.h"
 #include "timer.h"
 #include "toolbar.h"
+#include "ui_queue.h"
+#include "command.h"
 
 #include "user_list.h"
 
@@ -53,18 +64,70 @@ public:
     void chat_left();
 
     bool in_chat() const { return _room.get(); }
+
+    /*
+     * A live np1sec message. Each sender gets a token bucket (see
+     * rate_limiter.h), participants of our channels a bigger one, so
+     * that nobody can keep np1sec busy by flooding the room. Excess
+     * messages are dropped before np1sec or the capture sees them.
+     * History buffered for catching up has a limiter of its own.
+     */
     void on_received_data(std::string sender, std::string message);
 
+    /* The account's normalized form of a sender name, cached. */
+    const std::string& normalize_name(const char* name);
+
+    /*
+     * Historic (delayed) np1sec messages the server sends when we join.
+     * They are ignored unless NP1SEC_TEST_CLIENT_CATCH_UP is set, in
+     * which case those arriving during the join window are buffered and
+     * handed to np1sec as one ordered batch before any live message.
+     */
+    void on_received_history(std::string sender, std::string message);
+
+    /* While the display is held, room and channel windows collect lines
+     * without writing them out. */
+    bool display_held() const { return _display_held; }
+
     void send_chat_message(const std::string& message);
 
+    /*
+     * When NP1SEC_TEST_CLIENT_CAPTURE_DIR is set, every np1sec stanza
+     * sent or received after joining is appended to a capture file in
+     * that directory (see capture.h and tools/replay.cpp).
+     */
+    void start_capture(const std::string& directory);
+
+    /* Record a diagnostic (protocol event) message. */
     template<class... Args> void inform(Args&&... args);
 
+    /* Display a reply to something the user did in the room window. */
+    template<class... Args> void respond(Args&&... args);
+
+    void show_events();
+    std::string dump_events() const;
+
     void set_view(RoomView* v) { _room_view = v; }
     RoomView* get_view() { return _room_view; }
 
     const std::string& username() const { return _username; }
+    const Name& my_name() const { return _my_name; }
 
-    void user_left(const std::string&);
+    /*
+     * Usernames shown in this room's windows are interned here, so
+     * the room, its channels and its user lists share one copy of each
+     * and compare them by address. find_name doesn't intern anything.
+     */
+    Name intern(const std::string& username) { return _name_table.intern(username); }
+    Name find_name(boost::string_ref username) const { return _name_table.find(username); }
+
+    /*
+     * Presence changes reported by Pidgin. They are queued and applied
+     * together once the main loop is idle, a user who leaves and comes
+     * back in the meantime is never removed.
+     */
+    void buddy_joined(const std::string&);
+    void buddy_left(const std::string&);
 
     GtkWindow* gtk_window() const;
 
@@ -73,6 +136,31 @@ public:
 
     std::string room_name() const;
 
+    /*
+     * When the NP1SEC_TEST_CLIENT_WORKER_THREAD environment variable is
+     * set, all calls into np1sec (and therefore all np1sec callbacks) are
+     * executed in order on a worker thread owned by this room and their
+     * effects on the UI are marshalled back to the GTK main loop.
+     * Otherwise everything runs synchronously on the GTK thread.
+     */
+    bool threaded() const { return bool(_executor); }
+
+    /* Execute f on the np1sec thread. */
+    template<class F> void np1sec_post(F&& f);
+
+    /* Execute f on the np1sec thread and wait for it to finish. */
+    template<class F> void np1sec_call(F&& f);
+
+    /* Execute f on the GTK thread. */
+    template<class F> void ui_post(F&& f);
+
+    /*
+     * Replace where np1sec timers are scheduled (by default the GTK main
+     * loop or the worker thread). Must be done before the room is joined,
+     * while no timer is pending.
+     */
+    void set_timer_backend(std::unique_ptr<TimerBackend>);
+
 private:
     void display(const std::string& message);
     void display(const std::string& sender, const std::string& message);
@@ -100,36 +188,109 @@ private:
     static std::string sanitize_name(std::string name);
 
     bool interpret_as_command(const std::string&);
+    void cmd_whoami(const CommandArgs&);
+    void cmd_create_conversation(const CommandArgs&);
+    void cmd_events(const CommandArgs&);
+    void cmd_scrollback(const CommandArgs&);
+    void cmd_widgets(const CommandArgs&);
+    void cmd_rate_limit(const CommandArgs&);
     User* find_user_in_channel(const std::string& username);
     void add_user(const std::string& username, const PublicKey&);
-    void remove_user(const std::string& username);
+    void remove_users(const std::set<std::string>& usernames);
+    Channel* add_channel(np1sec::Conversation*);
+    void do_send_message(const std::string& message);
+
+    void end_catch_up();
+
+    static gboolean on_flush_presence(gpointer);
+    void flush_presence();
+    void reset_catch_up();
+    static gboolean on_catch_up_timeout(gpointer);
+    void hold_display(bool);
 
 private:
     friend class Channel;
 
-    using ChannelMap = std::map<np1sec::Conversation*, std::unique_ptr<Channel>>;
+    /* Rooms have a handful of channels, a sorted vector is faster to
+     * search and walk than a tree. Inserting and erasing moves the
+     * elements after the position, don't hold iterators across calls
+     * that may add or destroy channels. */
+    using ChannelMap = boost::container::flat_map< np1sec::Conversation*
+                                                 , std::unique_ptr<Channel>>;
 
     PurpleConversation *_conv;
+
+    /* Destroyed after everything holding a Name. */
+    NameTable _name_table;
+
     std::string _username;
+    Name _my_name;
+
+    std::thread::id _ui_thread_id;
+    UiQueue _ui_queue;
+    std::unique_ptr<Executor> _executor;
+    std::unique_ptr<TimerBackend> _timer_backend;
+
     TimerToken::Storage _timers;
     np1sec::PrivateKey _private_key;
 
     RoomView* _room_view = nullptr;
     ChannelMap _channels;
-    std::map<std::string, std::unique_ptr<UserList::User>> _users;
+
+    struct RoomUser {
+        PublicKey public_key;
+        std::unique_ptr<UserList::User> view;
+    };
+
+    std::map<Name, RoomUser> _users;
+
+    EventLog _events;
+    std::unique_ptr<EventLogDialog> _events_dialog;
 
     std::unique_ptr<Toolbar> _toolbar;
 
     std::unique_ptr<Np1SecRoom> _room;
 
+    std::unique_ptr<capture::Writer> _capture;
+
     ChannelView* _focused_channel = nullptr;
+
+    /* How long after joining we keep collecting history. */
+    static const guint catch_up_window_ms = 3000;
+    /* At most this many historic messages are buffered. */
+    static const size_t max_catch_up_messages = 10000;
+
+    const bool _catch_up_enabled;
+    bool _catching_up;
+    guint _catch_up_timer = 0;
+    std::deque<std::pair<std::string, std::string>> _history;
+
+    bool _display_held = false;
+
+    std::set<std::string> _pending_leaves;
+    guint _presence_source_id = 0;
+
+    NameCache _names;
+
+    /* Whether the sender has joined one of our channels. */
+    bool is_participant(const std::string& sender);
+
+    /* False if the message is to be dropped. */
+    bool rate_limit(RateLimiter&, const std::string& sender, const char* what);
+
+    /* np1sec messages per second and burst size, for anyone in the room
+     * and for participants of our channels. */
+    RateLimiter _rate_limiter{{5, 30}, {20, 100}};
+
+    /* The server sends history in one go, allow a bigger burst but keep
+     * one sender from filling the whole catch-up buffer. */
+    RateLimiter _history_rate_limiter{{20, 200}};
 };
 
 } // np1sec_plugin namespace
 
 /* Plugin headers */
 #include "channel.h"
-#include "parser.h"
 #include "room_view.h"
 
 namespace np1sec_plugin {
@@ -140,14 +301,61 @@ inline
 Room::Room(PurpleConversation* conv)
     : _conv(conv)
     , _username(sanitize_name(conv->account->username))
+    , _my_name(intern(_username))
+    , _ui_thread_id(std::this_thread::get_id())
     , _private_key(np1sec::PrivateKey::generate(true))
     , _toolbar(new Toolbar(PIDGIN_CONVERSATION(conv)))
+    , _catch_up_enabled(util::env_flag("NP1SEC_TEST_CLIENT_CATCH_UP"))
+    , _catching_up(_catch_up_enabled)
 {
     log(this, " Room::Room conv=", conv);
 
+    if (util::env_flag("NP1SEC_TEST_CLIENT_WORKER_THREAD")) {
+        _executor.reset(new Executor());
+        _timer_backend.reset(new ExecutorTimerBackend(*_executor));
+    }
+    else {
+        _timer_backend.reset(new GlibTimerBackend());
+    }
+
     _toolbar->add_button("Create conversation", [this] {
-        _room->create_conversation();
+        np1sec_post([this] {
+            if (_room) _room->create_conversation();
+        });
     });
+
+    _toolbar->add_button("Diagnostics", [this] { show_events(); });
+}
+
+template<class F>
+inline
+void Room::np1sec_post(F&& f)
+{
+    if (!_executor) return f();
+    _executor->post(std::forward<F>(f));
+}
+
+template<class F>
+inline
+void Room::np1sec_call(F&& f)
+{
+    if (!_executor) return f();
+    _executor->call(std::forward<F>(f));
+}
+
+template<class F>
+inline
+void Room::ui_post(F&& f)
+{
+    if (std::this_thread::get_id() == _ui_thread_id) return f();
+    _ui_queue.post(std::forward<F>(f));
+}
+
+inline
+void Room::set_timer_backend(std::unique_ptr<TimerBackend> backend)
+{
+    NP1SEC_CHECK(!in_chat() && backend);
+    _timer_backend = std::move(backend);
 }
 
 inline
@@ -157,9 +365,23 @@ void Room::chat_joined()
     if (in_chat()) return;
 
     _username = util::normalized_name(_conv);
+    _my_name  = intern(_username);
+
+    /* We may have reconnected to a different server. */
+    _names.clear();
+
+    if (const char* dir = std::getenv("NP1SEC_TEST_CLIENT_CAPTURE_DIR")) {
+        start_capture(dir);
+    }
+
+    np1sec_call([this] {
+        _room.reset(new Np1SecRoom(this, _username, _private_key));
+        _room->connect();
+    });
 
-    _room.reset(new Np1SecRoom(this, _username, _private_key));
-    _room->connect();
+    if (_catching_up) {
+        _catch_up_timer = g_timeout_add(catch_up_window_ms, on_catch_up_timeout, this);
+    }
 }
 
 inline
@@ -167,15 +389,26 @@ void Room::chat_left()
 {
     log(this, " Room::chat_left ", _room.get());
     if (!in_chat()) return;
-    _room.reset();
+    np1sec_call([this] { _room.reset(); });
     _channels.clear();
+    reset_catch_up();
+
+    _pending_leaves.clear();
+    _names.clear();
+    _rate_limiter.clear();
+    _history_rate_limiter.clear();
+
+    if (_presence_source_id) {
+        g_source_remove(_presence_source_id);
+        _presence_source_id = 0;
+    }
 }
 
 inline
 User* Room::find_user_in_channel(const std::string& username)
 {
     for (const auto& c : _channels | boost::adaptors::map_values) {
-        if (auto u = c->find_user(_username)) {
+        if (auto u = c->find_user(_my_name)) {
             return u;
         }
     }
@@ -187,12 +420,22 @@ Room::~Room()
 {
     log(this, " Room::~Room");
 
+    if (_catch_up_timer) g_source_remove(_catch_up_timer);
+    if (_presence_source_id) g_source_remove(_presence_source_id);
+
     /* Do this before we disconnect, that way channels may be able
      * to send a leave signal. */
     _channels.clear();
 
-    if (_room && _room->connected()) {
-        _room->disconnect();
+    np1sec_call([this] {
+        if (_room && _room->connected()) {
+            _room->disconnect();
+        }
+        _room.reset();
+    });
+
+    if (_executor) {
+        _executor->stop();
     }
 }
 
@@ -209,7 +452,7 @@ void Room::send_chat_message(const std::string& message)
          * We're sending from the main room (not a channel).
          * So send as plain text
          */
-        return send_message(message);
+        return do_send_message(message);
     }
 
     channel_view->send_chat_message(message);
@@ -218,46 +461,78 @@ void Room::send_chat_message(const std::string& message)
 inline
 bool Room::interpret_as_command(const std::string& cmd)
 {
-    using namespace std;
-
     if (cmd.empty() || cmd[0] != '.') {
         return false;
     }
 
-    Parser p(cmd.substr(1));
-
-    try {
-        inform("$ ", p.text);
+    static constexpr Command<Room> commands[] = {
+        { "whoami",              "",         0, 0, &Room::cmd_whoami },
+        { "create-conversation", "",         0, 0, &Room::cmd_create_conversation },
+        { "events",              "",         0, 0, &Room::cmd_events },
+        { "scrollback",          "[lines]",  0, 1, &Room::cmd_scrollback },
+        { "widgets",             "",         0, 0, &Room::cmd_widgets },
+        { "rate-limit",          "",         0, 0, &Room::cmd_rate_limit },
+    };
 
-        auto c = p.read_word();
+    auto line = boost::string_ref(cmd).substr(1);
 
-        if (c == "help") {
-            inform("<br>"
-                   "Available commands:<br>"
-                   "&nbsp;&nbsp;&nbsp;&nbsp;help<br>"
-                   "&nbsp;&nbsp;&nbsp;&nbsp;whoami<br>"
-                   "&nbsp;&nbsp;&nbsp;&nbsp;create-conversation<br>");
-        }
-        else if (c == "whoami") {
-            inform("You're ", _username);
-        }
-        else if (c == "create-conversation") {
-            _room->create_conversation();
-        }
-        else  {
-            inform("\"", p.text, "\" is not a valid np1sec command");
-            return true;
-        }
-    }
-    catch (...) {
-        return true;
-    }
+    respond("$ ", line);
+    dispatch_command(commands, *this, line);
 
     return true;
 }
 
+inline
+void Room::cmd_whoami(const CommandArgs&)
+{
+    respond("You're ", _username);
+}
+
+inline
+void Room::cmd_create_conversation(const CommandArgs&)
+{
+    np1sec_post([this] {
+        if (_room) _room->create_conversation();
+    });
+}
+
+inline
+void Room::cmd_events(const CommandArgs&)
+{
+    respond(dump_events());
+}
+
+inline
+void Room::cmd_scrollback(const CommandArgs& args)
+{
+    if (!_room_view) return;
+    auto& q = _room_view->display_queue();
+    if (!args.empty()) q.set_scrollback_limit(args.number(0));
+    respond("Scrollback: ", q.scrollback_info());
+}
+
+inline
+void Room::cmd_widgets(const CommandArgs&)
+{
+    if (!_room_view) return;
+    respond("Channel widgets: ", _room_view->channel_widgets().stats_info());
+}
+
+inline
+void Room::cmd_rate_limit(const CommandArgs&)
+{
+    respond("Received np1sec messages: ", _rate_limiter.stats_info(),
+            "; history: ", _history_rate_limiter.stats_info());
+}
+
 inline
 void Room::send_message(const std::string& message)
+{
+    ui_post([this, message] { do_send_message(message); });
+}
+
+inline
+void Room::do_send_message(const std::string& message)
 {
     if (!_room_view || !_room) {
         // TODO: Inform the user that the main chat window has been closed.
@@ -279,6 +554,8 @@ void Room::send_message(const std::string& message)
 
     //log(this, " Room::send_message ", message);
 
+    if (_capture) _capture->write(capture::Kind::sent, _username, message);
+
     serv_chat_send( gc
                   , purple_conv_chat_get_id(PURPLE_CONV_CHAT(conv))
                   , message.c_str()
@@ -288,117 +565,230 @@ void Room::send_message(const std::string& message)
 inline
 void Room::add_user(const std::string& username, const PublicKey& pubkey)
 {
-    if (_users.count(username)) {
-        assert(0 && "User is already in the room");
-        return;
-    }
+    auto name = intern(username);
+    auto i = _users.emplace(name, RoomUser{pubkey, nullptr});
 
-    auto u = new UserList::User();
+    NP1SEC_CHECK(i.second && "User is already in the room");
+    if (!i.second) return;
 
-    if (auto v = get_view()) {
-        u->bind(v->user_list());
-    }
-
-    _users[username] = std::unique_ptr<UserList::User>(u);
+    auto u = new UserList::User(name);
+    i.first->second.view.reset(u);
 
-    if (username == _username) {
-        u->set_text(username + " (self)");
+    if (name == _my_name) {
+        u->set_suffix(" (self)");
     }
-    else {
-        u->set_text(username);
+
+    if (auto v = get_view()) {
+        u->bind(v->user_list());
     }
 
     for (auto& c : _channels | boost::adaptors::map_values) {
-        c->add_user(username, pubkey);
+        c->add_user(name, pubkey);
     }
 }
 
 inline
 void Room::user_joined(const std::string& username, const PublicKey& pubkey)
 {
-    inform("Room::user_joined ", username);
-    add_user(username, pubkey);
+    ui_post([this, username, pubkey] {
+        inform("Room::user_joined ", username);
+        add_user(username, pubkey);
+    });
 }
 
 inline
-void Room::remove_user(const std::string& username)
+void Room::remove_users(const std::set<std::string>& usernames)
 {
-    _users.erase(username);
+    /* Look the strings up once for all channels. */
+    std::vector<Name> names;
 
-    for (auto& c : _channels | boost::adaptors::map_values) {
-        c->remove_user(username);
+    for (const auto& u : usernames) {
+        if (auto name = find_name(u)) names.push_back(std::move(name));
+    }
+
+    if (_room_view) _room_view->user_list().freeze();
+
+    for (const auto& n : names) {
+        _users.erase(n);
+    }
+
+    if (_room_view) _room_view->user_list().thaw();
+
+    /* A channel destroys itself once its last user is gone, which
+     * shifts the ones after it. */
+    std::vector<Channel*> channels;
+    channels.reserve(_channels.size());
+
+    for (const auto& c : _channels | boost::adaptors::map_values) {
+        channels.push_back(c.get());
+    }
+
+    for (auto c : channels) {
+        c->remove_users(names);
     }
 }
 
 inline
 void Room::user_left(const std::string& username, const PublicKey&)
 {
-    inform("Room::user_left ", username, " (event from np1sec)");
-    remove_user(username);
+    ui_post([this, username] {
+        inform("Room::user_left ", username, " (event from np1sec)");
+        remove_users({username});
+    });
 }
 
 inline
-void Room::user_left(const std::string& username)
+void Room::buddy_joined(const std::string& username)
 {
-    inform("Room::user_left ", username, " (event from pidgin)");
-    _room->user_left(username);
-    remove_user(username);
+    // Note the comment in plugin.cpp's chat_joined_cb function.
+    chat_joined();
+
+    _pending_leaves.erase(username);
 }
 
 inline
-np1sec::ConversationInterface*
-Room::created_conversation(np1sec::Conversation* c)
+void Room::buddy_left(const std::string& username)
 {
-    inform("Room::created_conversation ", size_t(c));
+    _pending_leaves.insert(username);
 
-    if (_channels.count(c) != 0) {
-        assert(0 && "Conversation already present");
-        return nullptr;
+    if (!_presence_source_id) {
+        _presence_source_id = g_idle_add(on_flush_presence, this);
     }
+}
 
-    auto channel = new Channel(c, *this);
-    _channels.emplace(c, std::unique_ptr<Channel>(channel));
+inline
+gboolean Room::on_flush_presence(gpointer data)
+{
+    auto self = reinterpret_cast<Room*>(data);
+    self->_presence_source_id = 0;
+    self->flush_presence();
+    // Returning FALSE removes the idle source.
+    return FALSE;
+}
 
-    return channel;
+inline
+void Room::flush_presence()
+{
+    auto leaves = std::move(_pending_leaves);
+    _pending_leaves.clear();
+
+    if (leaves.empty()) return;
+
+    inform("Room::user_left ", leaves.size(), " user(s) (event from pidgin)");
+
+    np1sec_post([this, leaves] {
+        if (!_room) return;
+        for (const auto& u : leaves) _room->user_left(u);
+    });
+
+    remove_users(leaves);
+}
+
+inline
+np1sec::ConversationInterface*
+Room::created_conversation(np1sec::Conversation* c)
+{
+    ui_post([this, c] {
+        inform("Room::created_conversation ", size_t(c));
+    });
+
+    return add_channel(c);
 }
 
 inline
 np1sec::ConversationInterface*
 Room::invited_to_conversation(np1sec::Conversation* c, const std::string& by)
 {
-    inform("Room::invited_to_conversation by ", by);
+    ui_post([this, by] {
+        inform("Room::invited_to_conversation by ", by);
+    });
 
-    if (_channels.count(c) != 0) {
-        assert(0 && "Conversation already present");
-        return nullptr;
-    }
+    return add_channel(c);
+}
+
+/*
+ * Called on the np1sec thread. The channel is returned to np1sec right
+ * away but it is only added to _channels and given a view once the GTK
+ * thread gets to it.
+ */
+inline
+Channel* Room::add_channel(np1sec::Conversation* c)
+{
+    auto channel = new Channel(c, *this);
+
+    ui_post([this, c, channel] {
+        auto i = _channels.emplace(c, nullptr);
 
-    auto p = new Channel(c, *this);
-    _channels.emplace(c, std::unique_ptr<Channel>(p));
-    return p;
+        NP1SEC_CHECK(i.second && "Conversation already present");
+        if (!i.second) {
+            delete channel;
+            return;
+        }
+
+        i.first->second.reset(channel);
+        channel->create_view();
+    });
+
+    return channel;
 }
 
 inline
 void Room::connected()
 {
-    inform("Room::connected()");
-    add_user(_username, _private_key.public_key());
+    ui_post([this] {
+        inform("Room::connected()");
+        add_user(_username, _private_key.public_key());
+    });
 }
 
 inline
 void Room::disconnected()
 {
-    inform("Room::disconnected()");
-    _users.erase(_username);
+    ui_post([this] {
+        inform("Room::disconnected()");
+        _users.erase(_my_name);
+    });
 }
 
 template<class... Args>
 inline
 void Room::inform(Args&&... args)
 {
-    log(this, " Room::inform: ", util::str(std::forward<Args>(args)...));
+    auto text = util::str(std::forward<Args>(args)...);
+    log(this, " Room::inform: ", text);
+    _events.push(std::move(text));
+}
 
-    display(_username, util::inform_str(std::forward<Args>(args)...));
+template<class... Args>
+inline
+void Room::respond(Args&&... args)
+{
+    if (!_room_view) return;
+    _room_view->display_queue().push_notice(_username,
+            util::inform_str(std::forward<Args>(args)...));
+}
+
+inline
+void Room::show_events()
+{
+    if (!_events_dialog) {
+        _events_dialog.reset(new EventLogDialog(_events, "(n+1)sec events: " + room_name()));
+    }
+
+    _events_dialog->show(gtk_window());
+}
+
+inline
+std::string Room::dump_events() const
+{
+    std::string result = "<br>Events:";
+
+    _events.for_each([&result] (const EventLog::Entry& e) {
+        result += "<br>";
+        result += e.text;
+    });
+
+    return result;
 }
 
 inline
@@ -413,25 +803,149 @@ inline
 void Room::display(const std::string& sender, const std::string& message)
 {
     if (!_room_view) return;
+    _room_view->display(sender, message);
+}
 
-    // TODO: Move the below code into RoomView.
+inline
+void Room::on_received_data(std::string sender, std::string message)
+{
+    if (!rate_limit(_rate_limiter, sender, "messages")) return;
 
-    auto conv = _room_view->purple_conv();
+    /* History must reach np1sec before anything live. */
+    if (_catching_up) end_catch_up();
 
-    /* conv->ui_ops->write_chat isn't set (is NULL) on Pidgin. */
-    assert(conv && conv->ui_ops && conv->ui_ops->write_conv);
-    conv->ui_ops->write_conv(conv,
-                             sender.c_str(),
-                             sender.c_str(),
-                             message.c_str(),
-                             PURPLE_MESSAGE_RECV,
-                             time(NULL));
+    if (_capture) _capture->write(capture::Kind::received, sender, message);
+
+    np1sec_post([this, sender, message] {
+        if (_room) _room->message_received(sender, message);
+    });
 }
 
 inline
-void Room::on_received_data(std::string sender, std::string message)
+bool Room::rate_limit(RateLimiter& limiter, const std::string& sender, const char* what)
+{
+    /* Our own messages echoed back by the server are never limited. */
+    if (sender == _username) return true;
+
+    switch (limiter.take(sender, is_participant(sender))) {
+        case RateLimiter::Verdict::pass:
+            return true;
+        case RateLimiter::Verdict::first_drop:
+            inform("Dropping np1sec ", what, " from ", sender, " (rate limit)");
+            return false;
+        case RateLimiter::Verdict::drop:
+            return false;
+    }
+
+    return false;
+}
+
+inline
+bool Room::is_participant(const std::string& sender)
+{
+    auto name = find_name(sender);
+    if (!name) return false;
+
+    for (const auto& c : _channels | boost::adaptors::map_values) {
+        auto u = c->find_user(name);
+        if (u && u->has_joined()) return true;
+    }
+
+    return false;
+}
+
+inline
+const std::string& Room::normalize_name(const char* name)
+{
+    return _names.normalize(_conv->account, name);
+}
+
+inline
+void Room::on_received_history(std::string sender, std::string message)
 {
-    _room->message_received(sender, message);
+    if (_catching_up && !rate_limit(_history_rate_limiter, sender, "history")) {
+        return;
+    }
+
+    if (_capture) _capture->write(capture::Kind::history, sender, message);
+
+    if (!_catching_up) return;
+
+    if (_history.size() == max_catch_up_messages) {
+        _history.pop_front();
+    }
+
+    _history.emplace_back(std::move(sender), std::move(message));
+}
+
+inline
+void Room::end_catch_up()
+{
+    _catching_up = false;
+
+    if (_catch_up_timer) {
+        g_source_remove(_catch_up_timer);
+        _catch_up_timer = 0;
+    }
+
+    if (_history.empty()) return;
+
+    inform("Room: catching up on ", _history.size(), " historic messages");
+
+    hold_display(true);
+
+    np1sec_post([this, batch = std::move(_history)] {
+        for (const auto& sender_and_message : batch) {
+            if (!_room) break;
+            _room->message_received(sender_and_message.first,
+                                    sender_and_message.second);
+        }
+
+        ui_post([this] { hold_display(false); });
+    });
+
+    _history.clear();
+}
+
+inline
+void Room::reset_catch_up()
+{
+    if (_catch_up_timer) {
+        g_source_remove(_catch_up_timer);
+        _catch_up_timer = 0;
+    }
+
+    _history.clear();
+    _catching_up = _catch_up_enabled;
+    hold_display(false);
+}
+
+inline
+gboolean Room::on_catch_up_timeout(gpointer data)
+{
+    auto self = reinterpret_cast<Room*>(data);
+    self->_catch_up_timer = 0;
+    self->end_catch_up();
+    // Returning 0 stops the timer.
+    return 0;
+}
+
+inline
+void Room::hold_display(bool held)
+{
+    if (_display_held == held) return;
+
+    _display_held = held;
+
+    if (_room_view) {
+        _room_view->display_queue().set_held(held);
+    }
+
+    for (auto& c : _channels | boost::adaptors::map_values) {
+        if (auto cv = c->channel_view()) {
+            cv->display_queue().set_held(held);
+        }
+    }
 }
 
 inline
@@ -447,7 +961,7 @@ std::string Room::sanitize_name(std::string name)
 inline
 np1sec::TimerToken*
 Room::set_timer(uint32_t interval_ms, np1sec::TimerCallback* callback) {
-    return new TimerToken(_timers, interval_ms, callback);
+    return new TimerToken(_timers, *_timer_backend, interval_ms, callback);
 }
 
 inline
@@ -475,4 +989,23 @@ std::string Room::room_name() const
     return _conv->title;
 }
 
+inline
+void Room::start_capture(const std::string& directory)
+{
+    auto name = util::str(room_name(), "-", _username, "-", time(NULL));
+
+    for (auto& c : name) {
+        if (!isalnum(c) && c != '-') c = '_';
+    }
+
+    try {
+        _capture.reset(new capture::Writer(util::str(directory, "/", name, ".np1cap"),
+                                           _username, room_name()));
+        inform("Capturing np1sec traffic to ", _capture->path());
+    }
+    catch (const std::exception& e) {
+        inform("Capture not started: ", e.what());
+    }
+}
+
 } // namespace
@@ -18,7 +18,11 @@
 
 #pragma once
 
+#include "check.h"
 #include "defer.h"
+#include "display_queue.h"
+#include "channel_widgets.h"
+#include "log.h"
 
 #include <pidgin/gtkimhtml.h>
 
@@ -42,14 +46,31 @@ public:
 
     PurpleConversation* purple_conv() { return _conv; }
 
+    void display(const std::string& sender, const std::string& message);
+
+    DisplayQueue& display_queue() { return _display_queue; }
+
+    /* Widgets for a new ChannelView of this room, and back. */
+    std::unique_ptr<ChannelWidgets> take_channel_widgets();
+    void recycle_channel_widgets(std::unique_ptr<ChannelWidgets>);
+
+    const ChannelWidgetsPool& channel_widgets() const { return _channel_widgets; }
+
 private:
     std::shared_ptr<Room> _room;
 
     PurpleConversation* _conv;
     PidginConversation* _gtkconv;
 
+    /* Rows of all user lists of this room, including the channels'. */
+    std::shared_ptr<UserModel> _user_model;
+
     std::unique_ptr<UserList> _user_list;
 
+    DisplayQueue _display_queue;
+
+    ChannelWidgetsPool _channel_widgets;
+
     GtkWidget* _content;
     GtkWidget* _parent;
 
@@ -76,30 +97,28 @@ namespace np1sec_plugin {
 inline RoomView::RoomView(PurpleConversation* conv, const std::shared_ptr<Room>& room)
     : _room(room)
     , _conv(conv)
+    , _user_model(std::make_shared<UserModel>())
+    , _channel_widgets(_user_model)
 {
-    assert(_room->get_view() == nullptr);
+    NP1SEC_CHECK(_room->get_view() == nullptr);
     _room->set_view(this);
 
-    // TODO: Throw instead of assert.
+    _display_queue.set_conversation(_conv);
+
+    // TODO: Throw instead of returning.
 
     _gtkconv = PIDGIN_CONVERSATION(_conv);
 
-    if (!_gtkconv) {
-        assert(0 && "Not a pidgin conversation");
-        return;
-    }
+    NP1SEC_CHECK(_gtkconv && "Not a pidgin conversation");
+    if (!_gtkconv) return;
 
     _content = gtk_widget_get_parent(_gtkconv->lower_hbox);
 
-    if (!GTK_IS_CONTAINER(_content)) {
-        assert(0);
-        return;
-    }
+    NP1SEC_CHECK(GTK_IS_CONTAINER(_content));
+    if (!GTK_IS_CONTAINER(_content)) return;
 
-    if (!GTK_IS_BOX(_content)) {
-        assert(0);
-        return;
-    }
+    NP1SEC_CHECK(GTK_IS_BOX(_content));
+    if (!GTK_IS_BOX(_content)) return;
 
     _parent = gtk_widget_get_parent(_content);
 
@@ -115,12 +134,8 @@ inline RoomView::RoomView(PurpleConversation* conv, const std::shared_ptr<Room>&
 
     _target = util::gtk::get_nth_child(output_window_position, GTK_CONTAINER(_content));
 
-    assert(GTK_IS_PANED(_target));
-
-    if (!_target) {
-        assert(_target);
-        return;
-    }
+    NP1SEC_CHECK(GTK_IS_PANED(_target));
+    if (!_target) return;
 
     _userlist = gtk_paned_get_child2(GTK_PANED(_target));
     g_object_ref_sink(_userlist);
@@ -133,7 +148,8 @@ inline RoomView::RoomView(PurpleConversation* conv, const std::shared_ptr<Room>&
     gtk_paned_pack2(GTK_PANED(_target), _vpaned, FALSE, TRUE);
     gtk_paned_pack1(GTK_PANED(_vpaned), _userlist, TRUE, TRUE);
 
-    _user_list.reset(new UserList("(n+1)sec users"));
+    _user_list.reset(new UserList("(n+1)sec users", _user_model,
+                                  UserList::Options{true, true}));
     gtk_paned_pack2(GTK_PANED(_vpaned), _user_list->root_widget(), TRUE, TRUE);
 
     {
@@ -148,7 +164,7 @@ inline RoomView::RoomView(PurpleConversation* conv, const std::shared_ptr<Room>&
 inline
 RoomView::~RoomView()
 {
-    assert(_room->get_view() == this);
+    NP1SEC_CHECK(_room->get_view() == this);
     _room->set_view(nullptr);
 
     gtk_container_remove(GTK_CONTAINER(_vpaned), _userlist);
@@ -158,6 +174,14 @@ RoomView::~RoomView()
 
     g_object_unref(_userlist);
     g_object_unref(_vpaned);
+
+    log("Channel widgets: ", _channel_widgets.stats_info());
+}
+
+inline
+void RoomView::display(const std::string& sender, const std::string& message)
+{
+    _display_queue.push(sender, message);
 }
 
 inline
@@ -166,6 +190,18 @@ UserList& RoomView::user_list()
     return *_user_list;
 }
 
+inline
+std::unique_ptr<ChannelWidgets> RoomView::take_channel_widgets()
+{
+    return _channel_widgets.take();
+}
+
+inline
+void RoomView::recycle_channel_widgets(std::unique_ptr<ChannelWidgets> w)
+{
+    _channel_widgets.recycle(std::move(w));
+}
+
 inline RoomView* get_room_view(PurpleConversation* conv) {
     auto p = purple_conversation_get_data(conv, "np1sec_room_view");
     return reinterpret_cast<RoomView*>(p);
@@ -18,8 +18,45 @@
 
 #pragma once
 
+#include <memory>
+#include <set>
+#include "executor.h"
+#include "timer_backend.h"
+
 namespace np1sec_plugin {
 
+/*
+ * Timers firing from the GTK main loop.
+ */
+class GlibTimerBackend final : public TimerBackend {
+public:
+    Id schedule(uint32_t interval_ms, Task) override;
+    void cancel(Id) override;
+
+private:
+    static gboolean on_timeout(gpointer);
+    static void on_destroy(gpointer);
+};
+
+/*
+ * Timers firing on an executor's thread.
+ */
+class ExecutorTimerBackend final : public TimerBackend {
+public:
+    ExecutorTimerBackend(Executor& executor) : _executor(executor) {}
+
+    Id schedule(uint32_t interval_ms, Task task) override {
+        return _executor.post_after(interval_ms, std::move(task));
+    }
+
+    void cancel(Id id) override {
+        _executor.cancel(id);
+    }
+
+private:
+    Executor& _executor;
+};
+
 class TimerToken final : public np1sec::TimerToken {
 public:
     class Storage : private std::set<TimerToken*> {
@@ -32,51 +69,85 @@ public:
     };
 
 public:
-
     TimerToken( Storage& storage
+              , TimerBackend& backend
               , uint32_t interval_ms
               , np1sec::TimerCallback* callback)
         : _storage(storage)
+        , _backend(backend)
         , _callback(callback)
     {
         _storage.insert(this);
-        _timer_id = g_timeout_add(interval_ms, execute_timer_callback, this);
+        _timer_id = _backend.schedule(interval_ms, [this] { fire(); });
     }
 
     void unset() override {
-        g_source_remove(_timer_id);
-        _timer_id = 0;
+        remove_source();
         delete this;
     }
 
     ~TimerToken() {
         _storage.erase(this);
-        if (_timer_id != 0) g_source_remove(_timer_id);
+        remove_source();
     }
 
 private:
-    static gboolean execute_timer_callback(gpointer gp_data);
+    void fire();
+
+    void remove_source() {
+        if (_timer_id == 0) return;
+        _backend.cancel(_timer_id);
+        _timer_id = 0;
+    }
 
 private:
     Storage& _storage;
+    TimerBackend& _backend;
     np1sec::TimerCallback* _callback;
-    guint _timer_id;
+    TimerBackend::Id _timer_id = 0;
 };
 
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
 inline
-gboolean TimerToken::execute_timer_callback(gpointer gp_data)
+TimerBackend::Id GlibTimerBackend::schedule(uint32_t interval_ms, Task task)
 {
-    auto* token = reinterpret_cast<TimerToken*>(gp_data);
+    return g_timeout_add_full(G_PRIORITY_DEFAULT,
+                              interval_ms,
+                              on_timeout,
+                              new Task(std::move(task)),
+                              on_destroy);
+}
 
-    auto callback = token->_callback;
+inline void GlibTimerBackend::cancel(Id id)
+{
+    /* The source is gone if it has already fired. */
+    if (auto source = g_main_context_find_source_by_id(NULL, guint(id))) {
+        g_source_destroy(source);
+    }
+}
 
-    token->_timer_id = 0;
-    delete token;
+inline gboolean GlibTimerBackend::on_timeout(gpointer data)
+{
+    (*reinterpret_cast<Task*>(data))();
+    // Returning FALSE stops the timer.
+    return FALSE;
+}
 
-    callback->execute();
+inline void GlibTimerBackend::on_destroy(gpointer data)
+{
+    delete reinterpret_cast<Task*>(data);
+}
 
-    // Returning 0 stops the timer.
-    return 0;
+inline void TimerToken::fire()
+{
+    auto callback = _callback;
+
+    _timer_id = 0;
+    delete this;
+
+    callback->execute();
 }
 
 } // np1sec_plugin namespace
@@ -0,0 +1,44 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace np1sec_plugin {
+
+/*
+ * Where np1sec timers (see TimerToken) are scheduled. A scheduled task
+ * runs at most once and not at all if it is cancelled before it fires.
+ */
+class TimerBackend {
+public:
+    using Id   = uint64_t;
+    using Task = std::function<void()>;
+
+    virtual ~TimerBackend() {}
+
+    /* Never returns 0. */
+    virtual Id schedule(uint32_t interval_ms, Task) = 0;
+
+    /* Cancelling a timer that already fired does nothing. */
+    virtual void cancel(Id) = 0;
+};
+
+} // np1sec_plugin namespace
@@ -0,0 +1,103 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace np1sec_plugin {
+
+/*
+ * Marshals functions from any thread onto the GTK main loop. Functions
+ * are executed in the order they were posted from a single idle
+ * callback. Functions still pending when the queue is destroyed are
+ * discarded.
+ */
+class UiQueue {
+public:
+    using Task = std::function<void()>;
+
+public:
+    UiQueue() = default;
+    ~UiQueue();
+
+    UiQueue(const UiQueue&) = delete;
+    UiQueue& operator=(const UiQueue&) = delete;
+
+    void post(Task);
+
+private:
+    static gboolean on_idle(gpointer);
+
+private:
+    std::mutex _mutex;
+    std::vector<Task> _tasks;
+    guint _source_id = 0;
+
+    /* Lets on_idle find out whether a task destroyed this queue. */
+    std::shared_ptr<bool> _alive = std::make_shared<bool>(true);
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline UiQueue::~UiQueue()
+{
+    *_alive = false;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_source_id) g_source_remove(_source_id);
+}
+
+inline void UiQueue::post(Task task)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _tasks.push_back(std::move(task));
+
+    if (!_source_id) {
+        _source_id = g_idle_add(on_idle, this);
+    }
+}
+
+inline gboolean UiQueue::on_idle(gpointer data)
+{
+    auto self = reinterpret_cast<UiQueue*>(data);
+    auto alive = self->_alive;
+
+    std::vector<Task> tasks;
+
+    {
+        std::lock_guard<std::mutex> lock(self->_mutex);
+        std::swap(tasks, self->_tasks);
+        self->_source_id = 0;
+    }
+
+    for (auto& task : tasks) {
+        if (!*alive) break;
+        task();
+    }
+
+    // Returning FALSE removes the idle source.
+    return FALSE;
+}
+
+} // np1sec_plugin namespace
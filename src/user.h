@@ -19,6 +19,7 @@
 #pragma once
 
 #include "src/crypto.h"
+#include "name.h"
 #include "popup.h"
 #include "user_list.h"
 
@@ -28,11 +29,11 @@ namespace np1sec_plugin {
 
 class Channel;
 
-class User {
+class User : public PopupTarget {
     using PublicKey = np1sec::PublicKey;
 
 public:
-    User(Channel& channel, const std::string& name, const PublicKey&);
+    User(Channel& channel, const Name& name, const PublicKey&);
 
     User(const User&) = delete;
     User& operator=(const User&) = delete;
@@ -40,7 +41,7 @@ public:
     User(User&&) = delete;
     User& operator=(User&&) = delete;
 
-    const std::string& name() const { return _name; }
+    const Name& name() const { return _name; }
 
 public:
     const PublicKey& public_key() const { return _public_key; }
@@ -64,13 +65,15 @@ public:
 
     bool never_joined() const { return _never_joined; }
 
+    void on_popup_action(PopupAction) override;
+
 private:
     UserList& joined_list() const;
     UserList& invited_list() const;
     UserList& other_list() const;
 
 private:
-    std::string _name;
+    Name _name;
     PublicKey _public_key;
     Channel& _channel;
     bool _is_myself;
@@ -91,11 +94,11 @@ namespace np1sec_plugin {
 // Implementation
 //------------------------------------------------------------------------------
 inline
-User::User(Channel& channel, const std::string& name, const PublicKey& pubkey)
+User::User(Channel& channel, const Name& name, const PublicKey& pubkey)
     : _name(name)
     , _public_key(pubkey)
     , _channel(channel)
-    , _is_myself(name == channel._room.username())
+    , _is_myself(name == channel._room.my_name())
 {
     insert_into(other_list());
 
@@ -109,7 +112,11 @@ User::User(Channel& channel, const std::string& name, const PublicKey& pubkey)
 
 inline void User::insert_into(UserList& list)
 {
-    _view.reset(new UserList::User());
+    /* Rebinding moves the existing row to the other list. */
+    if (!_view) {
+        _view.reset(new UserList::User(_name));
+        _view->target = this;
+    }
     _view->bind(list);
     update_view();
 }
@@ -118,39 +125,47 @@ inline void User::update_view()
 {
     if (!_view) return;
 
-    auto name = _name;
+    /* Called for every user on every membership change, so nothing in
+     * here allocates unless the text actually changes. */
 
     bool can_invite = !is_invited() && !has_joined() && !_is_in_chat;
 
     _view->popup_actions.clear();
+    _view->double_click_action = boost::none;
 
     if (can_invite) {
-        auto invite = [this] {
-            _channel.invite(_name, _public_key);
-        };
-
-        _view->popup_actions["Invite"] = invite;
-        _view->on_double_click = invite;
+        _view->popup_actions.insert(PopupAction::invite);
+        _view->double_click_action = PopupAction::invite;
     }
 
     if (_is_myself && is_invited() && !has_joined() && !_is_in_chat) {
-        auto join = [this] {
-            _channel._delegate->join();
-        };
-
-        _view->popup_actions["Join"] = join;
-        _view->on_double_click = join;
+        _view->popup_actions.insert(PopupAction::join);
+        _view->double_click_action = PopupAction::join;
     }
 
+    const char* suffix = "";
+
     if (has_joined() && !_is_in_chat) {
-        if (auto main_user = _channel.find_user(_channel.my_username())) {
+        if (auto main_user = _channel.find_user(_channel._room.my_name())) {
             if (main_user->has_joined()) {
-                name += " !c";
+                suffix = " !c";
             }
         }
     }
 
-    _view->set_text(name);
+    _view->set_suffix(suffix);
+}
+
+inline void User::on_popup_action(PopupAction action)
+{
+    switch (action) {
+        case PopupAction::invite:
+            _channel.invite(_name.str(), _public_key);
+            break;
+        case PopupAction::join:
+            _channel.join();
+            break;
+    }
 }
 
 inline bool User::has_joined() const
@@ -84,7 +84,7 @@ GtkWidget* UserInfoDialog::create_content(const User& user)
         gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
     };
 
-    append("Name: ", user.name());
+    append("Name: ", user.name().str());
 
     append("Public key: ", user.public_key().dump_hex());
 
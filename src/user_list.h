@@ -18,21 +18,47 @@
 
 #pragma once
 
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "check.h"
+#include "name.h"
 #include "defer.h"
 #include "popup.h"
 #include <boost/optional.hpp>
 
 namespace np1sec_plugin {
 
+class UserModel;
+struct UserRow;
+
 //------------------------------------------------------------------------------
 // UserList
 //------------------------------------------------------------------------------
+/*
+ * One pane of users. The rows live in a UserModel shared by all lists of
+ * a room, each list shows them through its own filter. Moving a user
+ * between lists of the same model changes the row in place.
+ *
+ * Rows have a fixed height so that GTK doesn't have to measure each of
+ * them, which matters in rooms with thousands of users.
+ */
 class UserList {
 public:
     class User;
 
+    struct Options {
+        /* Show the users ordered by name. */
+        bool sorted;
+        /* Add an entry above the list; only users whose name contains
+         * what's typed there are shown. */
+        bool search;
+    };
+
 public:
-    UserList(const std::string& label);
+    /* Sorted, without a search entry. */
+    UserList(const std::string& label, std::shared_ptr<UserModel>);
+    UserList(const std::string& label, std::shared_ptr<UserModel>, Options);
 
     UserList(UserList&&) = delete;
     UserList(const UserList&) = delete;
@@ -41,10 +67,24 @@ public:
 
     ~UserList();
 
-    GtkWidget* root_widget() { return GTK_WIDGET(_tree_view); }
+    GtkWidget* root_widget() { return _root; }
 
     bool is_in(const User&) const;
 
+    /*
+     * While frozen the filter is detached from the tree view so that any
+     * number of rows can be added, moved or changed with a single
+     * relayout once the list is thawed. Calls may be nested.
+     */
+    void freeze();
+    void thaw();
+
+    /* Detach all users and empty the list so that it can be reused. */
+    void reset();
+
+    /* Only show users whose name contains the text, ignoring case. */
+    void set_search_text(const std::string&);
+
 private:
     void setup_callbacks(GtkTreeView* tree_view);
 
@@ -58,19 +98,44 @@ private:
     gint on_button_pressed(GtkWidget*, GdkEventButton*, UserList*);
 
     static
-    boost::optional<size_t> path_to_pos(GtkTreePath*);
+    gboolean is_visible(GtkTreeModel*, GtkTreeIter*, gpointer);
+
+    static
+    void on_search_changed(GtkEditable*, UserList*);
+
+    static
+    void render_name( GtkTreeViewColumn*
+                    , GtkCellRenderer*
+                    , GtkTreeModel*
+                    , GtkTreeIter*
+                    , gpointer);
+
+    /* The user shown at the path of the view's model, if any. */
+    User* user_at(GtkTreePath*) const;
 
     void add_user(User*);
     void remove_user(User*);
+    void detach_users();
 
 private:
     friend class User;
 
+    std::shared_ptr<UserModel> _model;
+
+    GtkWidget* _root;
     GtkTreeView* _tree_view;
-    GtkListStore* _store;
+    GtkWidget* _search_entry = nullptr;
+
+    GtkTreeModel* _filter;
+    /* What the tree view shows: _filter, or a sorted model on top. */
+    GtkTreeModel* _view_model;
+
+    std::string _search_text;
+
+    std::vector<User*> _users;
+    std::set<gint>     _signal_handlers;
 
-    std::list<User*> _users;
-    std::set<gint>   _signal_handlers;
+    size_t _freeze_count = 0;
 };
 
 //------------------------------------------------------------------------------
@@ -79,16 +144,14 @@ private:
 class UserList::User {
     friend class UserList;
 
-    enum
-    {
-      COL_NAME = 0,
-      NUM_COLS
-    };
-
 public:
-    User();
+    /* Users of the same name share a row of the model. */
+    User(Name name);
+
+    /* Shown after the name, must be a string literal. The text is only
+     * put together when GTK draws the row. */
+    void set_suffix(const char*);
 
-    void set_text(std::string);
     void bind(UserList&);
 
     User(const User&) = delete;
@@ -97,39 +160,152 @@ public:
     User(User&&) = delete;
     User& operator=(User&&) = delete;
 
-    std::function<void()> on_double_click;
+    /* Where the popup and double click actions go. */
+    PopupTarget* target = nullptr;
+
     PopupActions popup_actions;
+    boost::optional<PopupAction> double_click_action;
 
     ~User();
 
 private:
-    void do_set_text(const std::string&);
+    UserList* _user_list = nullptr;
+    UserRow* _row = nullptr;
+    Name _name;
+    const char* _suffix = "";
+};
+
+//------------------------------------------------------------------------------
+// UserModel
+//------------------------------------------------------------------------------
+/*
+ * A row of the shared model: which list shows it as which user. A user
+ * is in at most one list per channel, so this stays short.
+ */
+struct UserRow {
+    Name name;
+    GtkTreeIter iter;
+    std::vector<std::pair<const UserList*, UserList::User*>> members;
+
+    UserList::User* member(const UserList*) const;
+
+    /* The name as searched, only made once a list is searched. */
+    const std::string& folded() const;
+
+    /* ASCII lower case, enough for nicks and JIDs. */
+    static std::string fold(std::string);
 
 private:
-    UserList* _user_list = nullptr;
-    std::string _text;
-    GtkTreeIter _iter;
+    mutable std::string _folded;
+};
+
+/*
+ * The users of a room, one row per name no matter in how many lists
+ * the name appears.
+ */
+class UserModel {
+public:
+    enum
+    {
+      COL_NAME = 0,
+      COL_ROW,
+      NUM_COLS
+    };
+
+public:
+    UserModel();
+    ~UserModel();
+
+    UserModel(const UserModel&) = delete;
+    UserModel& operator=(const UserModel&) = delete;
+
+    GtkTreeModel* tree_model() { return GTK_TREE_MODEL(_store); }
+
+    size_t size() const { return _rows.size(); }
+
+    UserRow* add(const Name&, const UserList*, UserList::User*);
+    void move(UserRow*, const UserList* from, const UserList* to);
+    void remove(UserRow*, const UserList*);
+
+    /* Make the lists filter and draw the row again. */
+    void changed(UserRow*);
+
+private:
+    GtkListStore* _store;
+    std::unordered_map<Name, std::unique_ptr<UserRow>, Name::Hash> _rows;
 };
 
 //------------------------------------------------------------------------------
 // UserList implementation
 //------------------------------------------------------------------------------
-inline UserList::UserList(const std::string& label)
+inline UserList::UserList(const std::string& label, std::shared_ptr<UserModel> model)
+    : UserList(label, std::move(model), Options{true, false})
+{
+}
+
+inline UserList::UserList( const std::string& label
+                         , std::shared_ptr<UserModel> model
+                         , Options options)
+    : _model(std::move(model))
 {
     _tree_view = GTK_TREE_VIEW(gtk_tree_view_new());
-    g_object_ref(_tree_view);
+    g_object_ref_sink(_tree_view);
+
+    auto renderer = gtk_cell_renderer_text_new();
+    gtk_cell_renderer_text_set_fixed_height_from_font(GTK_CELL_RENDERER_TEXT(renderer), 1);
+
+    gtk_tree_view_insert_column_with_data_func( _tree_view
+                                              , -1
+                                              , label.c_str()
+                                              , renderer
+                                              , render_name
+                                              , this
+                                              , NULL);
+
+    gtk_tree_view_column_set_sizing(gtk_tree_view_get_column(_tree_view, 0),
+                                    GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_set_fixed_height_mode(_tree_view, TRUE);
+
+    _filter = gtk_tree_model_filter_new(_model->tree_model(), NULL);
+    gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(_filter),
+                                           is_visible, this, NULL);
+
+    if (options.sorted) {
+        _view_model = gtk_tree_model_sort_new_with_model(_filter);
+        gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(_view_model),
+                                             UserModel::COL_NAME,
+                                             GTK_SORT_ASCENDING);
+    }
+    else {
+        _view_model = GTK_TREE_MODEL(g_object_ref(_filter));
+    }
+
+    gtk_tree_view_set_model(_tree_view, _view_model);
 
-    gtk_widget_show(GTK_WIDGET(_tree_view));
+    /* Without a search entry, typing in the list jumps to the first
+     * matching name. */
+    gtk_tree_view_set_search_column(_tree_view, UserModel::COL_NAME);
 
-    gtk_tree_view_insert_column_with_attributes( _tree_view
-                                               , -1
-                                               , label.c_str()
-                                               , gtk_cell_renderer_text_new()
-                                               , "text", User::COL_NAME
-                                               , NULL);
+    auto scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+                                   GTK_POLICY_AUTOMATIC,
+                                   GTK_POLICY_AUTOMATIC);
+    gtk_container_add(GTK_CONTAINER(scrolled), GTK_WIDGET(_tree_view));
 
-    _store = gtk_list_store_new(User::NUM_COLS, G_TYPE_STRING);
-    gtk_tree_view_set_model(_tree_view, GTK_TREE_MODEL(_store));
+    _root = gtk_vbox_new(FALSE, 0);
+    g_object_ref_sink(_root);
+
+    if (options.search) {
+        _search_entry = gtk_entry_new();
+        gtk_tree_view_set_enable_search(_tree_view, FALSE);
+        gtk_box_pack_start(GTK_BOX(_root), _search_entry, FALSE, FALSE, 0);
+
+        g_signal_connect(G_OBJECT(_search_entry), "changed",
+                         G_CALLBACK(on_search_changed), this);
+    }
+
+    gtk_box_pack_start(GTK_BOX(_root), scrolled, TRUE, TRUE, 0);
+    gtk_widget_show_all(_root);
 
     setup_callbacks(_tree_view);
 }
@@ -139,25 +315,93 @@ inline bool UserList::is_in(const User& u) const
     return u._user_list == this;
 }
 
-inline UserList::~UserList()
+inline void UserList::freeze()
 {
-    for (auto h_id : _signal_handlers) {
-        g_signal_handler_disconnect(G_OBJECT(_tree_view), h_id);
+    if (_freeze_count++ == 0) {
+        gtk_tree_view_set_model(_tree_view, NULL);
     }
+}
 
-    g_object_unref(_store);
-    g_object_unref(_tree_view);
+inline void UserList::thaw()
+{
+    NP1SEC_CHECK(_freeze_count);
+    if (_freeze_count && --_freeze_count == 0) {
+        gtk_tree_view_set_model(_tree_view, _view_model);
+    }
+}
+
+inline void UserList::reset()
+{
+    detach_users();
+
+    if (_freeze_count) {
+        _freeze_count = 0;
+        gtk_tree_view_set_model(_tree_view, _view_model);
+    }
+
+    if (_search_entry) {
+        /* Clears _search_text through on_search_changed. */
+        gtk_entry_set_text(GTK_ENTRY(_search_entry), "");
+    }
+}
+
+inline void UserList::set_search_text(const std::string& text)
+{
+    auto folded = UserRow::fold(text);
+
+    if (folded == _search_text) return;
+    _search_text = std::move(folded);
+
+    /* Only runs the visible function over the rows, the store and the
+     * other lists are left alone. */
+    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(_filter));
+}
 
+inline void UserList::on_search_changed(GtkEditable*, UserList* self)
+{
+    self->set_search_text(gtk_entry_get_text(GTK_ENTRY(self->_search_entry)));
+}
+
+inline void UserList::detach_users()
+{
     for (auto u : _users) {
+        _model->remove(u->_row, this);
         u->_user_list = nullptr;
+        u->_row = nullptr;
     }
+
+    _users.clear();
+}
+
+inline UserList::~UserList()
+{
+    for (auto h_id : _signal_handlers) {
+        g_signal_handler_disconnect(G_OBJECT(_tree_view), h_id);
+    }
+
+    if (_search_entry) {
+        g_signal_handlers_disconnect_by_func(G_OBJECT(_search_entry),
+                                             (gpointer) on_search_changed,
+                                             this);
+    }
+
+    /* The filter calls back into this object, drop it before the rows
+     * of our users are removed. */
+    gtk_tree_view_set_model(_tree_view, NULL);
+    g_object_unref(_view_model);
+    g_object_unref(_filter);
+    _filter = nullptr;
+
+    detach_users();
+
+    g_object_unref(_tree_view);
+    g_object_unref(_root);
 }
 
 inline
 void UserList::add_user(UserList::User* u)
 {
     _users.push_back(u);
-    gtk_list_store_append(_store, &u->_iter);
 }
 
 inline
@@ -165,26 +409,71 @@ void UserList::remove_user(UserList::User* u)
 {
     auto ui = std::find(_users.begin(), _users.end(), u);
 
-    assert(ui != _users.end());
-    _users.erase(ui);
+    NP1SEC_CHECK(ui != _users.end());
+    if (ui == _users.end()) return;
 
-    gtk_list_store_remove(_store, &u->_iter);
+    *ui = _users.back();
+    _users.pop_back();
 }
 
 inline
-boost::optional<size_t> UserList::path_to_pos(GtkTreePath* path)
+gboolean UserList::is_visible(GtkTreeModel* model, GtkTreeIter* iter, gpointer data)
 {
-    if (!path) return boost::none;
+    auto self = reinterpret_cast<const UserList*>(data);
+
+    UserRow* row = nullptr;
+    gtk_tree_model_get(model, iter, UserModel::COL_ROW, &row, -1);
+
+    if (!row || !row->member(self)) return FALSE;
 
-    gchar* c_str = gtk_tree_path_to_string(path);
-    auto free_str = defer([c_str] { g_free(c_str); });
+    return self->_search_text.empty()
+        || row->folded().find(self->_search_text) != std::string::npos;
+}
 
-    try {
-        return std::stoi(c_str);
+inline
+void UserList::render_name( GtkTreeViewColumn*
+                          , GtkCellRenderer* cell
+                          , GtkTreeModel* model
+                          , GtkTreeIter* iter
+                          , gpointer data)
+{
+    auto self = reinterpret_cast<const UserList*>(data);
+
+    UserRow* row = nullptr;
+    gtk_tree_model_get(model, iter, UserModel::COL_ROW, &row, -1);
+
+    auto u = row ? row->member(self) : nullptr;
+
+    if (!u) {
+        g_object_set(cell, "text", "", NULL);
+        return;
     }
-    catch (const std::exception&) { }
 
-    return boost::none;
+    if (!*u->_suffix) {
+        g_object_set(cell, "text", row->name.str().c_str(), NULL);
+        return;
+    }
+
+    /* Only the rows being drawn need the combined text, and GTK copies
+     * it, so one buffer does. */
+    static std::string text;
+    text.assign(row->name.str()).append(u->_suffix);
+
+    g_object_set(cell, "text", text.c_str(), NULL);
+}
+
+inline
+UserList::User* UserList::user_at(GtkTreePath* path) const
+{
+    if (!path || !_filter || _freeze_count) return nullptr;
+
+    GtkTreeIter iter;
+    if (!gtk_tree_model_get_iter(_view_model, &iter, path)) return nullptr;
+
+    UserRow* row = nullptr;
+    gtk_tree_model_get(_view_model, &iter, UserModel::COL_ROW, &row, -1);
+
+    return row ? row->member(this) : nullptr;
 }
 
 inline
@@ -193,20 +482,11 @@ void UserList::on_double_click( GtkTreeView *tree_view
                               , GtkTreeViewColumn *column
                               , UserList* v)
 {
-    auto pos = path_to_pos(path);
-
-    if (!pos) return;
+    auto user = v->user_at(path);
 
-    auto i = std::next(v->_users.begin(), *pos);
+    if (!user || !user->target || !user->double_click_action) return;
 
-    if (i == v->_users.end()) return;
-
-    if ((*i)->on_double_click) {
-        // Make a copy in case the callback wants to
-        // reset it.
-        auto f = (*i)->on_double_click;
-        f();
-    }
+    user->target->on_popup_action(*user->double_click_action);
 }
 
 // Return TRUE if we handled it.
@@ -224,18 +504,12 @@ gboolean UserList::on_button_pressed( GtkWidget*
 
         auto free_path = defer([path] { gtk_tree_path_free(path); });
 
-        auto pos = path_to_pos(path);
-
-        if (!pos) return FALSE;
+        auto* user = v->user_at(path);
 
-        auto user_i = std::next(v->_users.begin(), *pos);
+        if (!user) return FALSE;
 
-        if (user_i == v->_users.end()) return FALSE;
-
-        auto* user = *user_i;
-
-        if (!user->popup_actions.empty()) {
-            show_popup(event, user->popup_actions);
+        if (user->target && !user->popup_actions.empty()) {
+            show_popup(event, user->popup_actions, *user->target);
             return TRUE;
         }
     }
@@ -264,7 +538,8 @@ void UserList::setup_callbacks(GtkTreeView* tree_view)
 //------------------------------------------------------------------------------
 // UserList::User Implementation
 //------------------------------------------------------------------------------
-inline UserList::User::User()
+inline UserList::User::User(Name name)
+    : _name(std::move(name))
 {
 }
 
@@ -274,39 +549,150 @@ inline void UserList::User::bind(UserList& list)
         return;
     }
 
-    if (_user_list) {
+    if (_user_list && _user_list->_model == list._model) {
         _user_list->remove_user(this);
+        list._model->move(_row, _user_list, &list);
+    }
+    else {
+        if (_user_list) {
+            _user_list->remove_user(this);
+            _user_list->_model->remove(_row, _user_list);
+        }
+        _row = list._model->add(_name, &list, this);
     }
 
     _user_list = &list;
-
     list.add_user(this);
+}
 
-    if (!_text.empty()) {
-        do_set_text(_text);
-    }
+inline void UserList::User::set_suffix(const char* suffix)
+{
+    /* Literals, comparing the pointers is enough. */
+    if (suffix == _suffix) return;
+    _suffix = suffix;
+    if (!_user_list) return;
+    _user_list->_model->changed(_row);
 }
 
-inline void UserList::User::set_text(std::string str)
+inline UserList::User::~User()
 {
-    _text = std::move(str);
     if (!_user_list) return;
-    do_set_text(_text);
+    _user_list->remove_user(this);
+    _user_list->_model->remove(_row, _user_list);
 }
 
-inline void UserList::User::do_set_text(const std::string& str)
+//------------------------------------------------------------------------------
+// UserModel Implementation
+//------------------------------------------------------------------------------
+inline UserList::User* UserRow::member(const UserList* list) const
 {
-    assert(_user_list);
-    gtk_list_store_set(_user_list->_store, &_iter,
-                       COL_NAME, str.c_str(), -1);
+    for (const auto& m : members) {
+        if (m.first == list) return m.second;
+    }
+    return nullptr;
 }
 
-inline UserList::User::~User()
+inline const std::string& UserRow::folded() const
 {
-    if (!_user_list) return;
-    _user_list->remove_user(this);
+    if (_folded.empty()) _folded = fold(name.str());
+    return _folded;
 }
 
-} // np1sec_plugin namespace
+inline std::string UserRow::fold(std::string s)
+{
+    for (auto& c : s) {
+        if (c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+    }
+    return s;
+}
 
+inline UserModel::UserModel()
+{
+    _store = gtk_list_store_new(NUM_COLS, G_TYPE_STRING, G_TYPE_POINTER);
+}
 
+inline UserModel::~UserModel()
+{
+    /* Every list holds a reference to us, so by now all rows are gone. */
+    NP1SEC_CHECK(_rows.empty());
+    g_object_unref(_store);
+}
+
+inline UserRow* UserModel::add( const Name& name
+                              , const UserList* list
+                              , UserList::User* user)
+{
+    auto i = _rows.find(name);
+
+    if (i != _rows.end()) {
+        auto row = i->second.get();
+        NP1SEC_CHECK(!row->member(list));
+        row->members.emplace_back(list, user);
+        changed(row);
+        return row;
+    }
+
+    auto row = new UserRow();
+    row->name = name;
+    row->members.emplace_back(list, user);
+    _rows.emplace(name, std::unique_ptr<UserRow>(row));
+
+    /* Set the columns before the filters see the new row. GTK keeps
+     * its own copy of the name for sorting. */
+    gtk_list_store_insert_with_values(_store, &row->iter, -1,
+                                      COL_NAME, name.str().c_str(),
+                                      COL_ROW, row,
+                                      -1);
+    return row;
+}
+
+inline void UserModel::move(UserRow* row, const UserList* from, const UserList* to)
+{
+    for (auto& m : row->members) {
+        if (m.first != from) continue;
+        m.first = to;
+        changed(row);
+        return;
+    }
+
+    NP1SEC_CHECK(!"User isn't in the list it's moved from");
+}
+
+inline void UserModel::remove(UserRow* row, const UserList* list)
+{
+    auto& ms = row->members;
+
+    auto mi = std::find_if(ms.begin(), ms.end(),
+                           [list] (const std::pair<const UserList*, UserList::User*>& m) {
+                               return m.first == list;
+                           });
+
+    NP1SEC_CHECK(mi != ms.end());
+    if (mi == ms.end()) return;
+
+    *mi = ms.back();
+    ms.pop_back();
+
+    if (!ms.empty()) {
+        return changed(row);
+    }
+
+    /* GTK walks the whole store to answer this one. */
+    NP1SEC_CHECK_EXPENSIVE(gtk_list_store_iter_is_valid(_store, &row->iter));
+    gtk_list_store_remove(_store, &row->iter);
+
+    auto i = _rows.find(row->name);
+    NP1SEC_CHECK(i != _rows.end());
+    if (i != _rows.end()) _rows.erase(i);
+}
+
+inline void UserModel::changed(UserRow* row)
+{
+    auto model = GTK_TREE_MODEL(_store);
+
+    auto path = gtk_tree_model_get_path(model, &row->iter);
+    gtk_tree_model_row_changed(model, path, &row->iter);
+    gtk_tree_path_free(path);
+}
+
+} // np1sec_plugin namespace
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdlib>
 #include <set>
 #include <list>
 #include <ostream>
@@ -130,6 +132,21 @@ auto exec(const char* msg, F&& f, Args&&... args)
     return future.get();
 }
 
+/**
+ * Return true if the environment variable is set to "1", "true" or "yes"
+ * (case insensitive).
+ */
+inline bool env_flag(const char* name)
+{
+    const char* e = std::getenv(name);
+
+    if (!e) return false;
+
+    std::string env(e);
+    std::transform(env.begin(), env.end(), env.begin(), ::tolower);
+    return env == "1" || env == "true" || env == "yes";
+}
+
 static const char* normalize_name(PurpleAccount* account, const char* name)
 {
     auto info = PURPLE_PLUGIN_PROTOCOL_INFO(account->gc->prpl);
@@ -179,6 +196,39 @@ void set_text(GtkIMHtml* imhtml, const std::string& str) {
     gtk_imhtml_append_text(imhtml, str.c_str(), GtkIMHtmlOptions(0));
 }
 
+/**
+ * Delete whole lines from the beginning of the buffer so that at most
+ * max_lines remain.
+ */
+inline
+void trim_lines(GtkIMHtml* imhtml, size_t max_lines) {
+    auto buffer = imhtml->text_buffer;
+    auto line_count = size_t(gtk_text_buffer_get_line_count(buffer));
+
+    if (line_count <= max_lines) return;
+
+    GtkTextIter start, end;
+    gtk_text_buffer_get_start_iter(buffer, &start);
+    gtk_text_buffer_get_iter_at_line(buffer, &end, gint(line_count - max_lines));
+    gtk_imhtml_delete(imhtml, &start, &end);
+}
+
+/**
+ * A rough estimate of the memory held by the content of the buffer:
+ * the characters (counted as one byte each, the buffer keeps the counts
+ * so this doesn't touch the text) plus a fixed overhead per line for the
+ * btree nodes, tags and marks.
+ */
+inline
+size_t estimate_memory(GtkIMHtml* imhtml) {
+    static const size_t per_line_overhead = 128;
+
+    auto buffer = imhtml->text_buffer;
+
+    return size_t(gtk_text_buffer_get_char_count(buffer))
+         + size_t(gtk_text_buffer_get_line_count(buffer)) * per_line_overhead;
+}
+
 inline
 std::string tree_iter_to_path(const GtkTreeIter& iter, GtkTreeStore* store)
 {
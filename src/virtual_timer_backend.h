@@ -0,0 +1,140 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <map>
+#include <set>
+#include "timer_backend.h"
+
+namespace np1sec_plugin {
+
+/*
+ * A timer backend with its own clock which only moves when told to.
+ * Instead of waiting for a deadline, run_next() jumps straight to it, so
+ * hours worth of timeouts execute as fast as the tasks themselves allow.
+ * Tasks run in deadline order, tasks with the same deadline in the order
+ * they were scheduled, which makes runs reproducible.
+ *
+ * Nothing runs on its own and nothing is thread safe: whoever owns the
+ * backend drives it from a single thread.
+ */
+class VirtualTimerBackend final : public TimerBackend {
+public:
+    /* Milliseconds since the backend was created. */
+    uint64_t now() const { return _now; }
+
+    Id schedule(uint32_t interval_ms, Task) override;
+    void cancel(Id) override;
+
+    bool empty() const { return _deadlines.empty(); }
+    size_t pending() const { return _deadlines.size(); }
+
+    /* Deadline of the next task, must not be called when empty(). */
+    uint64_t next_deadline() const;
+
+    /* Move the clock to the next deadline and run that task. Returns
+     * false if there was nothing to run. */
+    bool run_next();
+
+    /* Run everything due within the next interval_ms and leave the
+     * clock at the end of it. Returns the number of tasks executed. */
+    size_t run_for(uint64_t interval_ms);
+
+    /* Discard all pending tasks, the clock stays where it is. */
+    void clear();
+
+private:
+    uint64_t _now = 0;
+    Id _next_id = 1;
+    std::map<Id, std::pair<uint64_t, Task>> _tasks;
+    std::set<std::pair<uint64_t, Id>> _deadlines;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+//------------------------------------------------------------------------------
+inline
+TimerBackend::Id VirtualTimerBackend::schedule(uint32_t interval_ms, Task task)
+{
+    auto id = _next_id++;
+    auto deadline = _now + interval_ms;
+
+    _tasks.emplace(id, std::make_pair(deadline, std::move(task)));
+    _deadlines.emplace(deadline, id);
+
+    return id;
+}
+
+inline void VirtualTimerBackend::cancel(Id id)
+{
+    auto i = _tasks.find(id);
+    if (i == _tasks.end()) return;
+
+    _deadlines.erase(std::make_pair(i->second.first, id));
+    _tasks.erase(i);
+}
+
+inline uint64_t VirtualTimerBackend::next_deadline() const
+{
+    assert(!empty());
+    return _deadlines.begin()->first;
+}
+
+inline bool VirtualTimerBackend::run_next()
+{
+    if (empty()) return false;
+
+    auto next = *_deadlines.begin();
+    _deadlines.erase(_deadlines.begin());
+
+    auto i = _tasks.find(next.second);
+    auto task = std::move(i->second.second);
+    _tasks.erase(i);
+
+    _now = next.first;
+
+    /* The task may schedule or cancel other tasks. */
+    task();
+
+    return true;
+}
+
+inline size_t VirtualTimerBackend::run_for(uint64_t interval_ms)
+{
+    auto end = _now + interval_ms;
+    size_t count = 0;
+
+    while (!empty() && next_deadline() <= end) {
+        run_next();
+        ++count;
+    }
+
+    _now = end;
+    return count;
+}
+
+inline void VirtualTimerBackend::clear()
+{
+    _tasks.clear();
+    _deadlines.clear();
+}
+
+} // np1sec_plugin namespace
@@ -0,0 +1,247 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Lists, summarizes or extracts part of one or more capture files (see
+ * src/capture.h). Time windows and senders are looked up in the capture's
+ * index, only the selected records are read from the mapped file.
+ *
+ * Usage: np1sec-capture [options] <capture file>...
+ */
+
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Plugin headers */
+#include "capture.h"
+
+using namespace np1sec_plugin;
+
+//------------------------------------------------------------------------------
+struct Options {
+    std::vector<std::string> paths;
+
+    double from_s = 0;
+    double to_s   = -1;
+    std::string sender;
+    std::string room;
+    std::string kind;
+
+    bool stats   = false;
+    bool payload = false;
+    bool reindex = false;
+    std::string output;
+};
+
+struct Stats {
+    size_t records = 0;
+    size_t bytes   = 0;
+};
+
+//------------------------------------------------------------------------------
+/*
+ * Calls f(record number) for each selected record of the file, in order.
+ */
+template<class F>
+static void select(const capture::File& file, const Options& options, F&& f)
+{
+    uint64_t from = uint64_t(options.from_s * 1e6);
+    uint64_t to   = options.to_s < 0 ? UINT64_MAX : uint64_t(options.to_s * 1e6);
+
+    auto range = file.time_range(from, to);
+
+    auto matches_kind = [&] (size_t i) {
+        if (options.kind.empty()) return true;
+        return options.kind == capture::kind_name(file.record(i).kind);
+    };
+
+    if (options.sender.empty()) {
+        for (auto i = range.first; i != range.second; ++i) {
+            if (matches_kind(i)) f(i);
+        }
+        return;
+    }
+
+    auto postings = file.records_from(options.sender);
+
+    /* Record numbers in the postings are increasing, find the first one
+     * inside the time window. */
+    size_t lo = 0, hi = postings.size();
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (postings[mid] < range.first) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (auto p = lo; p != postings.size() && postings[p] < range.second; ++p) {
+        if (matches_kind(postings[p])) f(postings[p]);
+    }
+}
+
+static void print_record(const capture::File& file, size_t i, bool payload)
+{
+    auto r = file.record(i);
+
+    std::cout << std::setw(10) << i
+              << std::setw(14) << std::fixed << std::setprecision(3) << r.time_us / 1e6
+              << std::setw(10) << capture::kind_name(r.kind)
+              << std::setw(10) << r.message.size()
+              << "  " << r.sender;
+
+    if (payload) std::cout << "  " << r.message;
+
+    std::cout << "\n";
+}
+
+static int query(const Options& options)
+{
+    std::unique_ptr<capture::Writer> output;
+    std::map<std::string, Stats> stats;
+
+    for (const auto& path : options.paths) {
+        capture::File file(path);
+
+        if (!options.room.empty() && file.room() != options.room) continue;
+
+        if (options.reindex) {
+            if (!file.indexed()) {
+                file.write_index();
+                std::cout << "Indexed " << path << "\n";
+            }
+            continue;
+        }
+
+        if (!options.output.empty()) {
+            output.reset(new capture::Writer(options.output, file.username(),
+                                             file.room(), file.start_us()));
+        }
+        else if (!options.stats) {
+            std::cout << "# " << path << ": " << file.username() << " in " << file.room()
+                      << ", " << file.size() << " records"
+                      << (file.indexed() ? "" : " (not indexed)") << "\n";
+        }
+
+        select(file, options, [&] (size_t i) {
+            if (output) {
+                auto r = file.record(i);
+                output->write(r.kind, r.time_us, r.sender, r.message);
+            }
+            else if (options.stats) {
+                auto r = file.record(i);
+                auto& s = stats[r.sender.to_string()];
+                ++s.records;
+                s.bytes += r.message.size();
+            }
+            else {
+                print_record(file, i, options.payload);
+            }
+        });
+    }
+
+    if (options.stats) {
+        std::cout << std::setw(10) << "records"
+                  << std::setw(14) << "bytes"
+                  << "  sender\n";
+
+        for (const auto& s : stats) {
+            std::cout << std::setw(10) << s.second.records
+                      << std::setw(14) << s.second.bytes
+                      << "  " << s.first << "\n";
+        }
+    }
+
+    return 0;
+}
+
+static void print_help(const char* argv0)
+{
+    std::cout << "Usage: " << argv0 << " [options] <capture file>...\n"
+              << "Options:\n"
+              << "  --from=<s>            # Start of the time window, seconds since the capture started\n"
+              << "  --to=<s>              # End of the time window\n"
+              << "  --sender=<name>       # Only records from this sender\n"
+              << "  --kind=<kind>         # Only received, sent or history records\n"
+              << "  --room=<name>         # Only captures of this room\n"
+              << "  --payload             # Also print the np1sec payload\n"
+              << "  --stats               # Print record counts and sizes per sender instead\n"
+              << "  --output=<file>       # Write the selection into a new capture file\n"
+              << "  --reindex             # Add an index to captures that were never closed\n"
+              << "                        # or whose index is corrupt\n";
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        auto value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+
+        try {
+            if      (key == "--from")    options.from_s  = std::stod(value);
+            else if (key == "--to")      options.to_s    = std::stod(value);
+            else if (key == "--sender")  options.sender  = value;
+            else if (key == "--kind")    options.kind    = value;
+            else if (key == "--room")    options.room    = value;
+            else if (key == "--payload") options.payload = true;
+            else if (key == "--stats")   options.stats   = true;
+            else if (key == "--output")  options.output  = value;
+            else if (key == "--reindex") options.reindex = true;
+            else if (key == "--help" || key == "-h") {
+                print_help(argv[0]);
+                return 0;
+            }
+            else if (key.substr(0, 2) != "--") {
+                options.paths.push_back(arg);
+            }
+            else {
+                std::cerr << "Error: unknown option \"" << arg << "\"" << std::endl;
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        catch (const std::exception&) {
+            std::cerr << "Error: invalid value in \"" << arg << "\"" << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.paths.empty()) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    if (!options.output.empty() && options.paths.size() != 1) {
+        std::cerr << "Error: --output takes exactly one capture file" << std::endl;
+        return 1;
+    }
+
+    try {
+        return query(options);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
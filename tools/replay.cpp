@@ -0,0 +1,302 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Feeds the stanzas of a capture file (see src/capture.h) into an np1sec
+ * room, the same way Room::on_received_data does in the plugin, and
+ * reports how long np1sec took to process them. No XMPP server or Pidgin
+ * is involved.
+ *
+ * By default records are fed as fast as possible while np1sec timers
+ * follow the recorded timestamps on a virtual clock. With --real-time
+ * (optionally sped up with --speed) the original pacing is reproduced.
+ *
+ * Usage: np1sec-replay [options] <capture file>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Np1sec headers */
+#include "src/interface.h"
+#include "src/room.h"
+#include "src/conversation.h"
+#include "src/crypto.h"
+
+/* Plugin headers */
+#include "capture.h"
+#include "virtual_timer_backend.h"
+
+using namespace np1sec_plugin;
+using WallClock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+struct Options {
+    std::string path;
+    bool   real_time       = false;
+    double speed           = 1;
+    bool   include_history = false;
+    size_t slowest         = 10;
+};
+
+//------------------------------------------------------------------------------
+class TimerToken final : public np1sec::TimerToken {
+public:
+    TimerToken(TimerBackend& backend, uint32_t interval_ms, np1sec::TimerCallback* callback)
+        : _backend(backend)
+    {
+        _id = _backend.schedule(interval_ms, [this, callback] {
+            delete this;
+            callback->execute();
+        });
+    }
+
+    void unset() override {
+        _backend.cancel(_id);
+        delete this;
+    }
+
+private:
+    TimerBackend& _backend;
+    TimerBackend::Id _id;
+};
+
+//------------------------------------------------------------------------------
+/*
+ * Stands in for the plugin's Room and Channel. Whatever np1sec wants to
+ * send goes nowhere, only the receive path is being replayed.
+ */
+class Sink final : public np1sec::RoomInterface
+                 , public np1sec::ConversationInterface {
+    using PublicKey = np1sec::PublicKey;
+
+public:
+    Sink(VirtualTimerBackend& clock) : _clock(clock) {}
+
+    size_t sent = 0;
+    size_t conversations = 0;
+    size_t chat_messages = 0;
+
+    /*
+     * np1sec::RoomInterface
+     */
+    void send_message(const std::string&) override { ++sent; }
+
+    np1sec::TimerToken* set_timer(uint32_t interval_ms, np1sec::TimerCallback* callback) override {
+        return new TimerToken(_clock, interval_ms, callback);
+    }
+
+    void connected() override {}
+    void disconnected() override {}
+
+    void user_joined(const std::string&, const PublicKey&) override {}
+    void user_left(const std::string&, const PublicKey&) override {}
+
+    np1sec::ConversationInterface* created_conversation(np1sec::Conversation*) override {
+        ++conversations;
+        return this;
+    }
+
+    np1sec::ConversationInterface* invited_to_conversation(np1sec::Conversation*, const std::string&) override {
+        ++conversations;
+        return this;
+    }
+
+    /*
+     * np1sec::ConversationInterface
+     */
+    void user_invited(const std::string&, const std::string&) override {}
+    void invitation_cancelled(const std::string&, const std::string&) override {}
+    void user_authenticated(const std::string&, const PublicKey&) override {}
+    void user_authentication_failed(const std::string&) override {}
+    void user_joined(const std::string&) override {}
+    void user_left(const std::string&) override {}
+    void votekick_registered(const std::string&, const std::string&, bool) override {}
+    void user_joined_chat(const std::string&) override {}
+
+    void message_received(const std::string&, const std::string&) override {
+        ++chat_messages;
+    }
+
+    void joined() override {}
+    void joined_chat() override {}
+    void left() override {}
+
+private:
+    VirtualTimerBackend& _clock;
+};
+
+//------------------------------------------------------------------------------
+struct Sample {
+    size_t index;
+    uint64_t time_us;
+    std::string sender;
+    size_t size;
+    double process_us;
+};
+
+static int replay(const Options& options)
+{
+    using namespace std::chrono;
+
+    capture::File file(options.path);
+
+    VirtualTimerBackend clock;
+    Sink sink(clock);
+
+    np1sec::Room room(&sink, file.username(), np1sec::PrivateKey::generate(true));
+    room.connect();
+
+    std::vector<Sample> samples;
+    size_t bytes = 0;
+    double process_us = 0;
+
+    auto wall_start = WallClock::now();
+
+    for (size_t index = 0; index != file.size(); ++index) {
+        auto record = file.record(index);
+
+        if (record.kind == capture::Kind::sent) continue;
+        if (record.kind == capture::Kind::history && !options.include_history) continue;
+
+        /* Timers which were due before this record fire first. */
+        auto record_ms = record.time_us / 1000;
+        if (record_ms > clock.now()) clock.run_for(record_ms - clock.now());
+
+        if (options.real_time) {
+            auto at = wall_start + microseconds(uint64_t(record.time_us / options.speed));
+            std::this_thread::sleep_until(at);
+        }
+
+        auto start = WallClock::now();
+        room.message_received(record.sender.to_string(), record.message.to_string());
+        auto us = duration_cast<nanoseconds>(WallClock::now() - start).count() / 1000.0;
+
+        process_us += us;
+        bytes += record.message.size();
+        samples.push_back(Sample{index, record.time_us, record.sender.to_string(), record.message.size(), us});
+    }
+
+    /* Give timeouts started by the last records a minute to fire. np1sec
+     * re-arms some timers forever, so don't wait for the clock to be
+     * empty. */
+    clock.run_for(60 * 1000);
+
+    auto wall_ms = duration_cast<microseconds>(WallClock::now() - wall_start).count() / 1000.0;
+
+    std::cout << "Capture:        " << options.path << "\n"
+              << "User, room:     " << file.username() << ", " << file.room() << "\n"
+              << "Replayed:       " << samples.size() << " stanzas, " << bytes << " bytes\n"
+              << "Processing:     " << long(process_us / 1000) << " ms"
+              << " (wall " << long(wall_ms) << " ms)\n";
+
+    if (samples.empty()) return 0;
+
+    std::cout << "Throughput:     " << long(samples.size() / std::max(process_us, 1.0) * 1e6) << " stanzas/s\n"
+              << "Mean:           " << long(process_us / samples.size()) << " us/stanza\n"
+              << "Np1sec output:  " << sink.sent << " stanzas, "
+                                    << sink.conversations << " conversations, "
+                                    << sink.chat_messages << " chat messages\n";
+
+    auto n = std::min(options.slowest, samples.size());
+
+    std::partial_sort(samples.begin(), samples.begin() + n, samples.end(),
+                      [] (const Sample& a, const Sample& b) { return a.process_us > b.process_us; });
+
+    std::cout << "\nSlowest stanzas:\n"
+              << std::setw(8)  << "#"
+              << std::setw(12) << "at ms"
+              << std::setw(12) << "us"
+              << std::setw(10) << "bytes"
+              << "  sender\n";
+
+    for (size_t i = 0; i != n; ++i) {
+        const auto& s = samples[i];
+        std::cout << std::setw(8)  << s.index
+                  << std::setw(12) << s.time_us / 1000
+                  << std::setw(12) << long(s.process_us)
+                  << std::setw(10) << s.size
+                  << "  " << s.sender << "\n";
+    }
+
+    return 0;
+}
+
+static void print_help(const char* argv0)
+{
+    std::cout << "Usage: " << argv0 << " [options] <capture file>\n"
+              << "Options:\n"
+              << "  --real-time           # Keep the recorded pacing\n"
+              << "  --speed=<factor>      # With --real-time, replay this many times faster\n"
+              << "  --include-history     # Also replay history received when joining\n"
+              << "  --slowest=<n>         # Number of slowest stanzas to list (default 10)\n";
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        auto value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+
+        try {
+            if      (key == "--real-time")       options.real_time       = true;
+            else if (key == "--speed")           options.speed           = std::stod(value);
+            else if (key == "--include-history") options.include_history = true;
+            else if (key == "--slowest")         options.slowest         = std::stoul(value);
+            else if (key == "--help" || key == "-h") {
+                print_help(argv[0]);
+                return 0;
+            }
+            else if (key.substr(0, 2) != "--" && options.path.empty()) {
+                options.path = arg;
+            }
+            else {
+                std::cerr << "Error: unknown option \"" << arg << "\"" << std::endl;
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        catch (const std::exception&) {
+            std::cerr << "Error: invalid value in \"" << arg << "\"" << std::endl;
+            return 1;
+        }
+    }
+
+    if (options.path.empty() || options.speed <= 0) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    try {
+        return replay(options);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,569 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2016, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs N (n+1)sec participants in a single process, connected through a
+ * simulated MUC with configurable latency, jitter and loss. For each N
+ * it creates a conversation, invites everyone, waits until every
+ * participant is in chat (i.e. the "!c" marker would be gone in every
+ * window) and then measures chat throughput.
+ *
+ * Network deliveries and np1sec timers share one virtual clock which
+ * jumps straight to the next deadline, so timeouts cost no wall time and
+ * a run with a given seed is reproducible. With --real-time the clock is
+ * paced to follow wall time instead. Reported times are simulated time.
+ *
+ * Usage: np1sec-simulator [--clients=5,10,20] [--latency-ms=50]
+ *                         [--jitter-ms=10] [--loss=0] [--messages=20]
+ *                         [--timeout-s=300] [--seed=1] [--real-time]
+ */
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Np1sec headers */
+#include "src/interface.h"
+#include "src/room.h"
+#include "src/conversation.h"
+#include "src/crypto.h"
+
+/* Plugin headers */
+#include "virtual_timer_backend.h"
+
+using np1sec_plugin::TimerBackend;
+using np1sec_plugin::VirtualTimerBackend;
+using WallClock = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+struct Options {
+    std::vector<size_t> clients = {5, 10, 20};
+    uint32_t latency_ms = 50;
+    uint32_t jitter_ms  = 10;
+    double   loss       = 0;
+    size_t   messages   = 20;
+    uint32_t timeout_s  = 300;
+    unsigned seed       = 1;
+    bool     real_time  = false;
+};
+
+/* The *_ms fields are simulated time, the *_wall_ms ones real time
+ * spent simulating. */
+struct Result {
+    bool   joined = false;
+    double join_ms = 0;
+    double join_wall_ms = 0;
+    bool   chatted = false;
+    double messages_per_s = 0;
+    double chat_wall_ms = 0;
+    size_t stanzas = 0;
+    size_t dropped = 0;
+    double wall_ms = 0;
+};
+
+static double wall_ms_since(WallClock::time_point start)
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(WallClock::now() - start).count() / 1000.0;
+}
+
+class Simulation;
+
+//------------------------------------------------------------------------------
+class TimerToken final : public np1sec::TimerToken {
+public:
+    TimerToken(TimerBackend& backend, uint32_t interval_ms, np1sec::TimerCallback* callback)
+        : _backend(backend)
+    {
+        _id = _backend.schedule(interval_ms, [this, callback] {
+            delete this;
+            callback->execute();
+        });
+    }
+
+    void unset() override {
+        _backend.cancel(_id);
+        delete this;
+    }
+
+private:
+    TimerBackend& _backend;
+    TimerBackend::Id _id;
+};
+
+//------------------------------------------------------------------------------
+class Client final : public np1sec::RoomInterface
+                   , public np1sec::ConversationInterface {
+    using PublicKey = np1sec::PublicKey;
+
+public:
+    Client(Simulation& sim, std::string name)
+        : _sim(sim)
+        , _name(std::move(name))
+        , _private_key(np1sec::PrivateKey::generate(true))
+    {}
+
+    const std::string& name() const { return _name; }
+
+    void connect();
+    void receive(const std::string& sender, const std::string& message);
+
+    bool knows_everyone(size_t n) const { return _users.size() == n; }
+    bool is_fully_in_chat(size_t n) const;
+    bool received_from_everyone(size_t n, size_t messages) const;
+
+    void create_conversation() { _room->create_conversation(); }
+    void invite_everyone();
+    void send_chat(const std::string& m) { if (_conversation) _conversation->send_chat(m); }
+
+    void disconnect();
+
+    /*
+     * np1sec::RoomInterface
+     */
+    void send_message(const std::string& message) override;
+    np1sec::TimerToken* set_timer(uint32_t interval_ms, np1sec::TimerCallback* callback) override;
+
+    void connected() override {}
+    void disconnected() override {}
+
+    void user_joined(const std::string& username, const PublicKey& key) override;
+    void user_left(const std::string& username, const PublicKey&) override;
+
+    np1sec::ConversationInterface* created_conversation(np1sec::Conversation*) override;
+    np1sec::ConversationInterface* invited_to_conversation(np1sec::Conversation*, const std::string&) override;
+
+    /*
+     * np1sec::ConversationInterface
+     */
+    void user_invited(const std::string&, const std::string&) override {}
+    void invitation_cancelled(const std::string&, const std::string&) override {}
+    void user_authenticated(const std::string&, const PublicKey&) override {}
+    void user_authentication_failed(const std::string&) override {}
+    void user_joined(const std::string&) override {}
+    void user_left(const std::string&) override {}
+    void votekick_registered(const std::string&, const std::string&, bool) override {}
+
+    void user_joined_chat(const std::string&) override;
+    void message_received(const std::string& sender, const std::string& message) override;
+
+    void joined() override {}
+    void joined_chat() override;
+    void left() override { _conversation = nullptr; }
+
+private:
+    Simulation& _sim;
+    std::string _name;
+    np1sec::PrivateKey _private_key;
+    std::unique_ptr<np1sec::Room> _room;
+    np1sec::Conversation* _conversation = nullptr;
+    std::map<std::string, PublicKey> _users;
+    std::map<std::string, size_t> _received;
+};
+
+//------------------------------------------------------------------------------
+class Simulation {
+public:
+    Simulation(const Options& options)
+        : _options(options)
+        , _rng(options.seed)
+    {}
+
+    Result run(size_t n);
+
+    VirtualTimerBackend& clock() { return _clock; }
+
+    /* Run f as soon as the current task is done. */
+    template<class F> void post(F&& f) { _clock.schedule(0, std::forward<F>(f)); }
+
+    /* The simulated MUC: every client (including the sender) receives
+     * the message, each with its own latency but in the same order. */
+    void broadcast(const std::string& sender, const std::string& message);
+
+    /* Re-evaluate the condition of the current phase. */
+    void check();
+
+private:
+    enum class Phase { idle, connecting, joining, chatting };
+
+    /* Run tasks until the phase's condition holds or it times out. */
+    bool wait_for(Phase);
+
+private:
+    const Options& _options;
+    VirtualTimerBackend _clock;
+    std::mt19937 _rng;
+
+    std::vector<std::unique_ptr<Client>> _clients;
+    std::map<Client*, uint64_t> _last_delivery;
+
+    size_t _stanzas = 0;
+    size_t _dropped = 0;
+
+    /* Where the clocks stood when the run started, for --real-time. */
+    uint64_t _virtual_start = 0;
+    WallClock::time_point _wall_start;
+
+    Phase _phase = Phase::idle;
+    bool _phase_done = false;
+};
+
+//------------------------------------------------------------------------------
+// Client
+//------------------------------------------------------------------------------
+void Client::connect()
+{
+    _room.reset(new np1sec::Room(this, _name, _private_key));
+    _room->connect();
+}
+
+void Client::disconnect()
+{
+    if (_room && _room->connected()) _room->disconnect();
+    _room.reset();
+}
+
+void Client::receive(const std::string& sender, const std::string& message)
+{
+    if (_room) _room->message_received(sender, message);
+}
+
+void Client::send_message(const std::string& message)
+{
+    _sim.broadcast(_name, message);
+}
+
+np1sec::TimerToken* Client::set_timer(uint32_t interval_ms, np1sec::TimerCallback* callback)
+{
+    return new TimerToken(_sim.clock(), interval_ms, callback);
+}
+
+void Client::user_joined(const std::string& username, const PublicKey& key)
+{
+    _users.emplace(username, key);
+    _sim.check();
+}
+
+void Client::user_left(const std::string& username, const PublicKey&)
+{
+    _users.erase(username);
+}
+
+np1sec::ConversationInterface* Client::created_conversation(np1sec::Conversation* c)
+{
+    _conversation = c;
+
+    /* Invite outside of the np1sec callback. */
+    _sim.post([this] { invite_everyone(); });
+
+    return this;
+}
+
+np1sec::ConversationInterface*
+Client::invited_to_conversation(np1sec::Conversation* c, const std::string&)
+{
+    _conversation = c;
+    _sim.post([this] { if (_conversation) _conversation->join(); });
+    return this;
+}
+
+void Client::invite_everyone()
+{
+    for (const auto& u : _users) {
+        if (u.first == _name) continue;
+        _conversation->invite(u.first, u.second);
+    }
+}
+
+void Client::user_joined_chat(const std::string&)
+{
+    _sim.check();
+}
+
+void Client::joined_chat()
+{
+    _sim.check();
+}
+
+void Client::message_received(const std::string& sender, const std::string&)
+{
+    ++_received[sender];
+    _sim.check();
+}
+
+bool Client::is_fully_in_chat(size_t n) const
+{
+    if (!_conversation || !_conversation->in_chat()) return false;
+
+    auto participants = _conversation->participants();
+
+    if (participants.size() != n) return false;
+
+    for (const auto& p : participants) {
+        if (!_conversation->participant_in_chat(p)) return false;
+    }
+
+    return true;
+}
+
+bool Client::received_from_everyone(size_t n, size_t messages) const
+{
+    size_t senders = 0;
+
+    for (const auto& r : _received) {
+        if (r.first == _name) continue;
+        if (r.second < messages) return false;
+        ++senders;
+    }
+
+    return senders == n - 1;
+}
+
+//------------------------------------------------------------------------------
+// Simulation
+//------------------------------------------------------------------------------
+void Simulation::broadcast(const std::string& sender, const std::string& message)
+{
+    ++_stanzas;
+
+    std::uniform_real_distribution<double> loss(0, 1);
+    std::uniform_int_distribution<int> jitter(-int(_options.jitter_ms), int(_options.jitter_ms));
+
+    auto now = _clock.now();
+
+    for (auto& c : _clients) {
+        if (_options.loss > 0 && loss(_rng) < _options.loss) {
+            ++_dropped;
+            continue;
+        }
+
+        auto delay = std::max(0, int(_options.latency_ms) + jitter(_rng));
+        auto deadline = now + delay;
+
+        /* A MUC delivers to each occupant in order. Tasks with equal
+         * deadlines run in the order they were scheduled. */
+        auto& last = _last_delivery[c.get()];
+        deadline = std::max(deadline, last);
+        last = deadline;
+
+        auto client = c.get();
+        _clock.schedule(uint32_t(deadline - now), [client, sender, message] {
+            client->receive(sender, message);
+        });
+    }
+}
+
+void Simulation::check()
+{
+    auto n = _clients.size();
+    bool done = true;
+
+    for (const auto& c : _clients) {
+        switch (_phase) {
+            case Phase::idle:       done = false; break;
+            case Phase::connecting: done = c->knows_everyone(n); break;
+            case Phase::joining:    done = c->is_fully_in_chat(n); break;
+            case Phase::chatting:   done = c->received_from_everyone(n, _options.messages); break;
+        }
+        if (!done) break;
+    }
+
+    if (done) _phase_done = true;
+}
+
+bool Simulation::wait_for(Phase phase)
+{
+    _phase = phase;
+    _phase_done = false;
+
+    /* The condition may already hold. */
+    check();
+
+    auto timeout = _clock.now() + uint64_t(_options.timeout_s) * 1000;
+
+    while (!_phase_done && !_clock.empty() && _clock.next_deadline() <= timeout) {
+        if (_options.real_time) {
+            auto at = _wall_start + std::chrono::milliseconds(_clock.next_deadline() - _virtual_start);
+            std::this_thread::sleep_until(at);
+        }
+        _clock.run_next();
+    }
+
+    return _phase_done;
+}
+
+Result Simulation::run(size_t n)
+{
+    Result result;
+
+    _virtual_start = _clock.now();
+    _wall_start = WallClock::now();
+
+    _last_delivery.clear();
+    _stanzas = 0;
+    _dropped = 0;
+
+    for (size_t i = 0; i != n; ++i) {
+        _clients.emplace_back(new Client(*this, "user" + std::to_string(i)));
+    }
+
+    for (auto& c : _clients) c->connect();
+
+    if (wait_for(Phase::connecting)) {
+        _stanzas = 0;
+        _dropped = 0;
+
+        auto join_start = _clock.now();
+        auto join_wall_start = WallClock::now();
+        _clients.front()->create_conversation();
+
+        result.joined = wait_for(Phase::joining);
+        result.join_ms = double(_clock.now() - join_start);
+        result.join_wall_ms = wall_ms_since(join_wall_start);
+    }
+    else {
+        std::cerr << "  timeout while connecting" << std::endl;
+    }
+
+    if (result.joined) {
+        auto chat_start = _clock.now();
+        auto chat_wall_start = WallClock::now();
+
+        for (size_t m = 0; m != _options.messages; ++m) {
+            for (auto& c : _clients) {
+                c->send_chat("message " + std::to_string(m));
+            }
+        }
+
+        result.chatted = wait_for(Phase::chatting);
+        result.chat_wall_ms = wall_ms_since(chat_wall_start);
+
+        auto s = std::max<uint64_t>(1, _clock.now() - chat_start) / 1000.0;
+        result.messages_per_s = double(n * _options.messages) / s;
+    }
+
+    result.stanzas = _stanzas;
+    result.dropped = _dropped;
+    _phase = Phase::idle;
+
+    for (auto& c : _clients) c->disconnect();
+    _clients.clear();
+
+    /* Whatever is still in flight was meant for the clients just
+     * destroyed. */
+    _clock.clear();
+
+    result.wall_ms = wall_ms_since(_wall_start);
+
+    return result;
+}
+
+//------------------------------------------------------------------------------
+static std::vector<size_t> parse_list(const std::string& s)
+{
+    std::vector<size_t> result;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) result.push_back(std::stoul(item));
+    return result;
+}
+
+static void print_help(const char* argv0)
+{
+    std::cout << "Usage: " << argv0 << " [options]\n"
+              << "Options:\n"
+              << "  --clients=<n,n,...>   # Participant counts to simulate (default 5,10,20)\n"
+              << "  --latency-ms=<ms>     # Delivery latency (default 50)\n"
+              << "  --jitter-ms=<ms>      # Maximum latency variation (default 10)\n"
+              << "  --loss=<0..1>         # Probability a delivery is lost (default 0)\n"
+              << "  --messages=<n>        # Chat messages sent by each participant (default 20)\n"
+              << "  --timeout-s=<s>       # Give up on a phase after this long (default 300)\n"
+              << "  --seed=<n>            # Random seed (default 1)\n"
+              << "  --real-time           # Pace the simulated clock to follow wall time\n";
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        auto value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+
+        try {
+            if      (key == "--clients")    options.clients    = parse_list(value);
+            else if (key == "--latency-ms") options.latency_ms = std::stoul(value);
+            else if (key == "--jitter-ms")  options.jitter_ms  = std::stoul(value);
+            else if (key == "--loss")       options.loss       = std::stod(value);
+            else if (key == "--messages")   options.messages   = std::stoul(value);
+            else if (key == "--timeout-s")  options.timeout_s  = std::stoul(value);
+            else if (key == "--seed")       options.seed       = std::stoul(value);
+            else if (key == "--real-time")  options.real_time  = true;
+            else if (key == "--help" || key == "-h") {
+                print_help(argv[0]);
+                return 0;
+            }
+            else {
+                std::cerr << "Error: unknown option \"" << arg << "\"" << std::endl;
+                print_help(argv[0]);
+                return 1;
+            }
+        }
+        catch (const std::exception&) {
+            std::cerr << "Error: invalid value in \"" << arg << "\"" << std::endl;
+            return 1;
+        }
+    }
+
+    Simulation sim(options);
+
+    std::cout << std::setw(8)  << "clients"
+              << std::setw(12) << "join ms"
+              << std::setw(12) << "join wall"
+              << std::setw(12) << "stanzas"
+              << std::setw(10) << "dropped"
+              << std::setw(12) << "msgs/s"
+              << std::setw(12) << "chat wall"
+              << std::setw(12) << "wall ms"
+              << std::endl;
+
+    for (auto n : options.clients) {
+        auto r = sim.run(n);
+
+        std::cout << std::setw(8) << n
+                  << std::setw(12) << (r.joined ? std::to_string(long(r.join_ms)) : "timeout")
+                  << std::setw(12) << long(r.join_wall_ms)
+                  << std::setw(12) << r.stanzas
+                  << std::setw(10) << r.dropped
+                  << std::setw(12) << (r.chatted ? std::to_string(long(r.messages_per_s)) : "-")
+                  << std::setw(12) << long(r.chat_wall_ms)
+                  << std::setw(12) << long(r.wall_ms)
+                  << std::endl;
+    }
+
+    return 0;
+}